@@ -27,8 +27,30 @@
 #include <ZL_Input.h>
 #include <ZL_Particles.h>
 #include <ZL_SynthImc.h>
+#include <chrono>
+#include <atomic>
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <time.h>
+#include <signal.h>
+#ifdef __linux__
+#include <unistd.h>
+#endif
+#if !defined(__wasm__) && !defined(__EMSCRIPTEN__)
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#define SHOOTZILLA_THREADS
+#endif
+#if defined(ZILLALOG) && !defined(SHOOTZILLA_ALLOCCHECK)
+#define SHOOTZILLA_ALLOCCHECK //debug builds count heap allocations for -alloccheck
+#endif
+#ifdef SHOOTZILLA_ALLOCCHECK
+#include <new>
+#endif
 
-static ZL_Mesh MeshGround, MeshWall, MeshBullet, MeshSpider, MeshBat, MeshGhost;
+static ZL_Mesh MeshGround, MeshWall, MeshWallLod, MeshBullet, MeshSpider, MeshBat, MeshGhost, MeshSpiderNoShadow, MeshBatNoShadow, MeshGhostNoShadow;
 #ifdef ZILLALOG
 static ZL_Mesh MeshDbgCollision, MeshDbgSphere;
 #endif
@@ -37,19 +59,23 @@ static ZL_Camera Camera;
 static ZL_Light LightSun, LightPlayer, *Lights[] = { &LightSun, &LightPlayer };
 static ZL_ParticleEmitter ParticleDamage, ParticleDestroy;
 static ZL_Font fntMain, fntBig, fntTitle;
-static ZL_Surface srfCrosshair;
+static ZL_Surface srfCrosshair, srfMinimap;
 static ZL_Sound sndBullet, sndHit, sndHit2, sndJump;
 static ZL_SynthImcTrack imcMusic;
 
 static bool IsTitle = true;
-static int wave, wavespawns, kills;
-static ticks_t waveticks, gameover;
+static ZL_Vector3 ViewDir = ZLV3(0,1,0); //owned by the main thread, the simulation gets it with every input
 
 enum { MAXMAPSIZE = 17, MAPW = 17, MAPH = 17 };
-static char Map[MAXMAPSIZE*MAXMAPSIZE+1];
-static float MapHeights[MAXMAPSIZE*MAXMAPSIZE+1];
 enum { TILE_EMPTY = ' ', TILE_WALL = '#' };
 
+// Maze and inner wall heights of a wave, the next one is generated on a worker thread while the current wave is played
+struct WaveLayout
+{
+	char map[MAXMAPSIZE*MAXMAPSIZE+1];
+	float wallbase[MAXMAPSIZE*MAXMAPSIZE+1];
+};
+
 const float SPEED_PITCH = 0.01f;
 const float SPEED_YAW = 0.01f;
 const float SPEED_ACCEL = 10.0f;
@@ -63,12 +89,79 @@ const float CAN_STEP_HEIGHT = 0.2f;
 const float VIEW_HEIGHT = 0.42f;
 const float WEAPON_DELAY = 0.1f;
 const float BULLET_SPEED = 10.0f;
+const float PERF_REPORT_SECONDS = 5.0f;
+const float IDLE_GAMEOVER_SETTLE = 3.0f;
+
+static struct sStress
+{
+	bool active = false, invulnerable = false;
+	int spiders = 0, bats = 0, ghosts = 0;
+	float weapondelay = WEAPON_DELAY;
+} Stress;
+
+static struct sPerf
+{
+	bool log = false, shadows = true;
+	double reporttime = 0;
+	float draw3dms = 0;
+	int triangles = 0, trianglesfull = 0;
+} Perf;
+
+// Scales costly work down when frames go over budget and back up when there is headroom again
+static const struct { float particles; bool enemyshadows; int minimapframes; unsigned int aiintervalscale; } GovernorLevels[] =
+{
+	{ 1.0f, true,  1, 1 },
+	{ 0.6f, true,  2, 1 },
+	{ 0.4f, false, 4, 2 },
+	{ 0.2f, false, 8, 3 },
+};
+enum { GOVERNOR_WINDOW = 30 };
+static struct sGovernor
+{
+	float budgetms = 1000.0f / 60;
+	int level = 0, frames = 0, overframes = 0, calmwindows = 0;
+	double workms = 0;
+} Governor;
+
+// Drawing every material once while loading moves shader compilation and uploads out of the first game frame
+static struct sWarmUp
+{
+	bool enabled = true, reported = false;
+	float ms = 0;
+} WarmUp;
+
+// Time from the first input event received for a frame until that frame has been submitted
+static struct sInputLatency
+{
+	bool active = false;
+	double pending = 0, reporttime = 0;
+} InputLatency;
+
+// Title and game over screens drop to a low frame rate after a while without input, game over is then frozen into a cached image
+static struct sIdle
+{
+	float fps = 10, delay = 2;
+	bool active = false, frozen = false;
+	double lastinput = 0, reporttime = 0, drawms = 0;
+	clock_t reportcpu = 0;
+	int frames = 0;
+	ZL_Surface srfFrozen;
+} Idle;
+static bool Hitscan;
+
+// Enemies further away than distance only re-plan every interval frames, and only while the frame's AI budget lasts
+static struct sAILod
+{
+	float distance = 6.0f, budgetms = 1.0f;
+	unsigned int interval = 4;
+} AILod;
 
 struct Thing
 {
 	enum Type { BULLET, PLAYER, ENEMY_SPIDER, ENEMY_BAT, ENEMY_GHOST, WORLD };
 	Thing(Type t, float r) : type(t), radius(r) {}
 	Type type;
+	unsigned int id = 0;
 	float radius;
 	ZL_Matrix mtx;
 	ZL_Vector3 vel;
@@ -88,110 +181,376 @@ struct Player : Thing
 struct Enemy : Thing
 {
 	Enemy(Type t, float r, float movspd, float atkdmg, float atkspd, float hlth) : Thing(t, r), movespeed(movspd), attackdamage(atkdmg), attackspeed(atkspd), health(hlth) {}
-	ZL_Vector movetarget;
 	float movespeed, attackdamage, attackspeed, attacktimer = 0, health;
+	unsigned int aiframe = 0;
 };
 struct EnemySpider : Enemy
 {
-	EnemySpider() : Enemy(ENEMY_SPIDER, 0.25f, RAND_RANGE(1.1f, 1.9f), RAND_RANGE(8,13), .5f, RAND_RANGE(.1, 1.5)) {}
+	EnemySpider(ZL_SeededRand& rnd, int) : Enemy(ENEMY_SPIDER, 0.25f, rnd.Range(1.1f, 1.9f), rnd.Range(8.f, 13.f), .5f, rnd.Range(.1f, 1.5f)) {}
 	ZL_Vector move;
 	ZL_Vector movetarget;
 };
 struct EnemyBat : Enemy
 {
-	EnemyBat() :    Enemy(ENEMY_BAT,    0.25f,  RAND_RANGE(1.5f, 2.5f), RAND_RANGE(11,15), .4f, RAND_RANGE(.9, 2.5)) {}
+	EnemyBat(ZL_SeededRand& rnd, int) :      Enemy(ENEMY_BAT,    0.25f, rnd.Range(1.5f, 2.5f), rnd.Range(11.f, 15.f), .4f, rnd.Range(.9f, 2.5f)) {}
+	ZL_Vector3 move;
 };
 struct EnemyGhost : Enemy
 {
-	EnemyGhost() :  Enemy(ENEMY_GHOST,  0.5f, RAND_RANGE(2.1f, 3.6f)+wave*0.05f, RAND_RANGE(13,20), .25f, RAND_RANGE(2, 9)) {}
+	EnemyGhost(ZL_SeededRand& rnd, int wave) : Enemy(ENEMY_GHOST,  0.5f, rnd.Range(2.1f, 3.6f)+wave*0.05f, rnd.Range(13.f, 20.f), .25f, rnd.Range(2.f, 9.f)) {}
+	ZL_Vector3 move;
 };
 
 static struct World : Thing { World() : Thing(WORLD, 0) {} } world;
 
-static Player player;
-static std::vector<Bullet> bullets;
-static std::vector<Enemy> enemies;
+// Linear allocator for temporaries, everything is released at once when the next frame starts
+// The buffer is only allocated on construction or by Reserve while nothing is in use, never by Alloc
+struct FrameArena
+{
+	FrameArena(size_t size) : buf(size) {}
+	void Reserve(size_t size) { ZL_ASSERT(!used); if (size > buf.size()) buf.resize(size); }
+	template <class T> T* Alloc(size_t n)
+	{
+		size_t at = (used + alignof(T) - 1) & ~(alignof(T) - 1);
+		if (at + n * sizeof(T) > buf.size()) return NULL;
+		used = at + n * sizeof(T);
+		if (used > peak) peak = used;
+		return (T*)(buf.data() + at);
+	}
+	size_t Mark() const { return used; }
+	void Release(size_t mark) { used = mark; }
+	void Reset() { used = 0; }
+	std::vector<unsigned char> buf;
+	size_t used = 0, peak = 0;
+};
 
-static void FadeWalls(float h)
+// Gameplay events of one simulation tick, the audio and particle systems turn them into effects once per drawn frame
+struct SimEvent
+{
+	enum Type : unsigned char { SHOT, JUMP, HIT, KILL, WALL_HIT, PLAYER_DAMAGED, PLAYER_KILLED, COUNT } type;
+	float radius;
+	ZL_Vector3 pos;
+};
+
+// DoCollision collects up to 3*3*5+2 world candidates plus every enemy for spiders in the tick arena, each at most this many bytes
+enum { COLLISION_WORLD_COLS = 3*3*5 + 2, COLLISION_COL_BYTES = 64, COLLISION_ARENA_MIN = COLLISION_WORLD_COLS * COLLISION_COL_BYTES };
+
+// Everything of one running game, the main game and any number of headless games of the batch runner are independent of each other
+struct GameState
+{
+	GameState() : rand(1), arena(COLLISION_ARENA_MIN) {}
+	~GameState()
+	{
+		#ifdef SHOOTZILLA_THREADS
+		if (!prepthread.joinable()) return;
+		{ std::lock_guard<std::mutex> lock(prepmutex); prepquit = true; }
+		prepcond.notify_all();
+		prepthread.join();
+		#endif
+	}
+
+	Player player;
+	std::vector<Bullet> bullets;
+	std::vector<EnemySpider> spiders;
+	std::vector<EnemyBat> bats;
+	std::vector<EnemyGhost> ghosts;
+	unsigned int thingids = 0;
+	int wave = 0, wavespawns = 0, kills = 0;
+	ticks_t waveticks = 0, gameover = 0, ticks = 0, elapsedticks = 0;
+	unsigned int aiframes = 0;
+	size_t aicursor = 0; //far enemy where the last frame's AI budget ran out
+
+	char map[MAXMAPSIZE*MAXMAPSIZE+1];
+	float heights[MAXMAPSIZE*MAXMAPSIZE+1], wallbase[MAXMAPSIZE*MAXMAPSIZE+1];
+	unsigned int mapversion = 0;
+
+	// the layout of the next wave, prepared on a worker thread unless this game already runs on one
+	// the worker is started once and then kept waiting for the next wave so no thread is created during play
+	bool asyncprep = true;
+	int prepwave = -1;
+	unsigned int prepseed = 0;
+	WaveLayout prep;
+	#ifdef SHOOTZILLA_THREADS
+	std::thread prepthread;
+	std::mutex prepmutex;
+	std::condition_variable prepcond;
+	bool prepbusy = false, prepquit = false;
+	#endif
+
+	ZL_SeededRand rand;
+	FrameArena arena; //temporaries of one tick, sized for the pools by ReservePools
+	bool headless = false;
+	std::vector<SimEvent>* events = NULL; //events of the current tick, NULL when headless
+	long long* metrics = NULL; //per frame metrics counters, only the main game is measured
+
+	float RandRange(float min, float max) { return rand.Range(min, max); }
+	int RandIntMax(int max) { return (int)(rand.UInt() % (unsigned int)(max + 1)); }
+	bool RandChance(int one_in) { return !(rand.UInt() % (unsigned int)one_in); }
+	void MetricAdd(int id, long long n = 1) { if (metrics) metrics[id] += n; }
+};
+static GameState Game;
+
+// Entities live in pools of fixed capacity that are reserved once at startup, spawning into a full pool is dropped
+enum { BULLET_CAPACITY = 1024, ENEMY_CAPACITY = 1024, EVENT_CAPACITY = 4096 };
+
+template <class F> static void ForEachEnemy(GameState& g, F f)
+{
+	for (EnemySpider& e : g.spiders) f(e);
+	for (EnemyBat& e : g.bats) f(e);
+	for (EnemyGhost& e : g.ghosts) f(e);
+}
+
+static int EnemyCount(GameState& g)
+{
+	return (int)(g.spiders.size() + g.bats.size() + g.ghosts.size());
+}
+
+// Everything Draw needs from one simulation tick, the simulation fills one buffer while the main thread draws the other
+struct RenderThing
+{
+	float radius, movespeed;
+	ZL_Vector3 pos;
+};
+struct RenderState
+{
+	bool title = true;
+	int wave = 0, enemiesleft = 0, kills = 0;
+	ticks_t waveticks = 0, gameover = 0, lasthit = 0;
+	float health = 0, maxhealth = 1;
+	ZL_Vector3 playerpos;
+	std::vector<RenderThing> bullets, spiders, bats, ghosts;
+	std::vector<SimEvent> events;
+	unsigned int mapversion = 0;
+	char map[MAXMAPSIZE*MAXMAPSIZE+1];
+	float heights[MAXMAPSIZE*MAXMAPSIZE+1];
+};
+static RenderState RenderStates[2];
+static int simbuf;
+
+static void ReservePools(GameState& g)
+{
+	g.bullets.reserve(BULLET_CAPACITY);
+	g.spiders.reserve(ENEMY_CAPACITY + Stress.spiders);
+	g.bats.reserve(ENEMY_CAPACITY + Stress.bats);
+	g.ghosts.reserve(ENEMY_CAPACITY + Stress.ghosts);
+	g.arena.Reserve(COLLISION_COL_BYTES * (COLLISION_WORLD_COLS + g.spiders.capacity() + g.bats.capacity() + g.ghosts.capacity()));
+}
+
+static void ReserveRenderStates(const GameState& g)
+{
+	for (RenderState& rs : RenderStates)
+	{
+		rs.bullets.reserve(g.bullets.capacity());
+		rs.spiders.reserve(g.spiders.capacity());
+		rs.bats.reserve(g.bats.capacity());
+		rs.ghosts.reserve(g.ghosts.capacity());
+		rs.events.reserve(EVENT_CAPACITY);
+	}
+}
+
+static void EmitEvent(GameState& g, SimEvent::Type type, const ZL_Vector3& pos = ZL_Vector3(), float radius = 0)
+{
+	if (g.events && g.events->size() != g.events->capacity()) g.events->push_back({ type, radius, pos });
+}
+
+// Named counters and gauges for the hot paths, aggregated per second and per wave when enabled with -metrics
+enum { METRIC_COLLISION_CANDIDATES, METRIC_PATH_NODES, METRIC_ARENA_OVERFLOWS, METRIC_PARTICLES, METRIC_SOUNDS, METRIC_BULLETS, METRIC_ENEMIES, METRIC_RENDER_ENTRIES, METRIC_TRIANGLES, METRIC_COUNT, METRIC_FIRST_GAUGE = METRIC_BULLETS };
+static const char* MetricNames[METRIC_COUNT] = { "collision_candidates", "path_nodes", "arena_overflows", "particles_spawned", "sounds", "bullets", "enemies", "render_entries", "triangles" };
+static long long MetricsFrame[METRIC_COUNT];
+static inline void MetricAdd(int id, long long n = 1) { MetricsFrame[id] += n; }
+static inline void MetricSet(int id, long long n) { MetricsFrame[id] = n; }
+
+static int ParticleCount(int full, int& budget)
+{
+	int n = ZL_Math::Min((int)(full * GovernorLevels[Governor.level].particles), budget);
+	budget -= n;
+	MetricAdd(METRIC_PARTICLES, n);
+	return n;
+}
+
+static void PlaySound(ZL_Sound& snd)
+{
+	snd.Play();
+	MetricAdd(METRIC_SOUNDS);
+}
+
+static FrameArena DrawArena(4096); //main thread
+
+static const char* DrawFormat(const char* format, ...)
+{
+	char* str = DrawArena.Alloc<char>(64);
+	if (!str) return "";
+	va_list ap;
+	va_start(ap, format);
+	vsnprintf(str, 64, format, ap);
+	va_end(ap);
+	return str;
+}
+
+// With SHOOTZILLA_ALLOCCHECK every heap allocation is counted so -alloccheck can verify that steady state frames don't allocate
+static std::atomic<unsigned int> HeapAllocations;
+#ifdef SHOOTZILLA_ALLOCCHECK
+void* operator new(size_t size)
+{
+	HeapAllocations.fetch_add(1, std::memory_order_relaxed);
+	void* p = malloc(size ? size : 1);
+	#if defined(__cpp_exceptions) || defined(_CPPUNWIND)
+	if (!p) throw std::bad_alloc();
+	#else
+	if (!p) abort(); //builds without exceptions terminate like the default operator new
+	#endif
+	return p;
+}
+void operator delete(void* p) noexcept { free(p); }
+#endif
+
+static double TimeMs()
+{
+	return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Samples are reserved for twice a report period at 60 fps so collecting them doesn't allocate
+struct FrameTimes
+{
+	FrameTimes(size_t reserve = (size_t)(PERF_REPORT_SECONDS * 60 * 2)) { samples.reserve(reserve); }
+	void Add(float ms) { samples.push_back(ms); }
+	float Percentile(float p) { return (samples.empty() ? 0 : samples[ZL_Math::Min((size_t)(p * samples.size()), samples.size()-1)]); }
+	void Report(const char* what)
+	{
+		sort(samples.begin(), samples.end());
+		printf("    %s ms: p50 %.2f  p90 %.2f  p99 %.2f  max %.2f  (%d frames)\n", what, Percentile(.5f), Percentile(.9f), Percentile(.99f), Percentile(1), (int)samples.size());
+		samples.clear();
+	}
+	std::vector<float> samples;
+};
+
+static int RenderListMapEntries;
+
+static void FadeWalls(GameState& g, float h)
+{
+	for (int y = 1; y != MAPH-1; y++)
+		for (int x = 1; x != MAPW-1; x++)
+			if (g.map[y*MAPW+x] == TILE_WALL)
+				g.heights[y*MAPW+x] = g.wallbase[y*MAPW+x] + h;
+	g.mapversion++;
+}
+
+static ZL_SeededRand RenderRand(1);
+
+// Walls further away from the camera than the LOD distance are drawn as a plain box, the margin keeps tiles at the threshold from flickering
+enum { TRIANGLES_WALL = 208*2, TRIANGLES_WALL_LOD = 6*2, TRIANGLES_SPRITE = 2 };
+static struct sWallLod
+{
+	float distance = 12.0f, margin = .5f;
+	bool far[MAXMAPSIZE*MAXMAPSIZE];
+	int triangles, trianglesfull;
+} WallLod;
+static ZL_Matrix WallMatrices[MAXMAPSIZE*MAXMAPSIZE];
+static bool WallUsed[MAXMAPSIZE*MAXMAPSIZE];
+
+static void BuildWallMatrices(const RenderState& rs)
 {
-	ZL_SeededRand rnd((unsigned)wave);
-	RenderListMap.Reset();
-	RenderListMap.Add(MeshGround, ZL_Matrix::Identity);
 	for (int y = 0; y != MAPH; y++)
 	for (int x = 0; x != MAPW; x++)
 	{
 		int i = y*MAPW+x;
+		WallUsed[i] = true;
 		if (x == 0 || x == MAPW-1 || y == 0 || y == MAPH-1)
-			RenderListMap.Add(MeshWall, ZL_Matrix::MakeRotateTranslate(ZL_Quat::FromRotateZ(0.01f*(PIHALF*(i%4))), ZLV3(x+.5f, y+.5f, MapHeights[i])));
-		else if (Map[i] == TILE_WALL)
-		{
-			MapHeights[i] = rnd.Range(0.2f, 0.8f) - 1 + h;
-			RenderListMap.Add(MeshWall, ZL_Matrix::MakeRotateTranslate(ZL_Quat::FromRotateZ(RAND_VARIATION(0.01)*(PIHALF*RAND_INT_MAX(3))), ZLV3(x+.5f, y+.5f, MapHeights[i])));
-		}
+			WallMatrices[i] = ZL_Matrix::MakeRotateTranslate(ZL_Quat::FromRotateZ(0.01f*(PIHALF*(i%4))), ZLV3(x+.5f, y+.5f, rs.heights[i]));
+		else if (rs.map[i] == TILE_WALL)
+			WallMatrices[i] = ZL_Matrix::MakeRotateTranslate(ZL_Quat::FromRotateZ(RenderRand.Range(.99f, 1.01f)*(PIHALF*(RenderRand.UInt()%4))), ZLV3(x+.5f, y+.5f, rs.heights[i]));
+		else
+			WallUsed[i] = false;
+	}
+}
+
+static bool UpdateWallLod(const ZL_Vector& campos)
+{
+	bool changed = false;
+	for (int i = 0; i != MAPW*MAPH; i++)
+	{
+		if (!WallUsed[i]) continue;
+		float distSq = campos.GetDistanceSq(ZLV((i%MAPW)+.5f, (i/MAPW)+.5f));
+		bool far = (WallLod.distance > 0 && distSq > ZL_Math::Square(WallLod.distance + (WallLod.far[i] ? -WallLod.margin : WallLod.margin)));
+		if (far != WallLod.far[i]) { WallLod.far[i] = far; changed = true; }
+	}
+	return changed;
+}
+
+static void BuildMapRenderList()
+{
+	RenderListMap.Reset();
+	RenderListMap.Add(MeshGround, ZL_Matrix::Identity);
+	RenderListMapEntries = 1;
+	WallLod.triangles = WallLod.trianglesfull = 2;
+	for (int i = 0; i != MAPW*MAPH; i++)
+	{
+		if (!WallUsed[i]) continue;
+		RenderListMap.Add((WallLod.far[i] ? MeshWallLod : MeshWall), WallMatrices[i]);
+		RenderListMapEntries++;
+		WallLod.triangles += (WallLod.far[i] ? TRIANGLES_WALL_LOD : TRIANGLES_WALL);
+		WallLod.trianglesfull += TRIANGLES_WALL;
 	}
 }
 
-static void SpawnEnemy()
+template <class E> static void SpawnInto(GameState& g, std::vector<E>& pool, const ZL_Vector3& epos)
+{
+	if (pool.size() == pool.capacity()) return; //pool is full
+	E e(g.rand, g.wave);
+	e.id = ++g.thingids;
+	e.mtx.SetTranslate(epos);
+	pool.push_back(e);
+}
+
+static void SpawnEnemy(GameState& g, Thing::Type etype)
 {
-	float enemytype = (RAND_FACTOR * (wave <= 2 ? .6f : (wave <= 4 ? .9f : 1.f))) + (wave <= 4 ? 0 : wave/15.0f);
-	Thing::Type etype = (enemytype < .6f ? Thing::ENEMY_SPIDER : (enemytype < .9f ? Thing::ENEMY_BAT : Thing::ENEMY_GHOST));
 	ZL_Vector3 epos;
 	for (;;)
 	{
 		switch (etype)
 		{
 			case Thing::ENEMY_SPIDER:
-				epos = ZLV3(1.5f + 2.0f*RAND_INT_MAX(MAPW/2-1), 1.5f + 2.0f*RAND_INT_MAX(MAPH/2-1), .15f);
+				epos = ZLV3(1.5f + 2.0f*g.RandIntMax(MAPW/2-1), 1.5f + 2.0f*g.RandIntMax(MAPH/2-1), .15f);
 				break;
 			case Thing::ENEMY_BAT:
-				epos = ZLV3(RAND_RANGE(2, MAPW-2), RAND_RANGE(2, MAPH-2), RAND_RANGE(1.5, 2.5));
+				epos = ZLV3(g.RandRange(2, MAPW-2), g.RandRange(2, MAPH-2), g.RandRange(1.5, 2.5));
 				break;
 			case Thing::ENEMY_GHOST:
-				epos = ZLV3(RAND_RANGE(2, MAPW-2), RAND_RANGE(2, MAPH-2), RAND_RANGE(1.7, 2.9));
+				epos = ZLV3(g.RandRange(2, MAPW-2), g.RandRange(2, MAPH-2), g.RandRange(1.7, 2.9));
 				break;
 			default:break;
 		}
-		if (epos.ToXY().GetDistanceSq(player.mtx.GetTranslateXY()) > (5.f*5.f))
+		if (epos.ToXY().GetDistanceSq(g.player.mtx.GetTranslateXY()) > (5.f*5.f))
 			break; // don't spawn close to the player
 	}
 	switch (etype)
 	{
-		case Thing::ENEMY_SPIDER:
-		{
-			EnemySpider e;
-			e.mtx.SetTranslate(epos);
-			enemies.push_back(e);
-			break;
-		}
-		case Thing::ENEMY_BAT:
-		{
-			EnemyBat e;
-			e.mtx.SetTranslate(epos);
-			enemies.push_back(e);
-			break;
-		}
-		case Thing::ENEMY_GHOST:
-		{
-			EnemyGhost e;
-			e.mtx.SetTranslate(epos);
-			enemies.push_back(e);
-			break;
-		}
+		case Thing::ENEMY_SPIDER: SpawnInto(g, g.spiders, epos); break;
+		case Thing::ENEMY_BAT:    SpawnInto(g, g.bats,    epos); break;
+		case Thing::ENEMY_GHOST:  SpawnInto(g, g.ghosts,  epos); break;
 		default:break;
 	}
 }
 
-static void StartWave()
+static void SpawnEnemy(GameState& g)
 {
+	float enemytype = (g.RandRange(0.f, 1.f) * (g.wave <= 2 ? .6f : (g.wave <= 4 ? .9f : 1.f))) + (g.wave <= 4 ? 0 : g.wave/15.0f);
+	SpawnEnemy(g, enemytype < .6f ? Thing::ENEMY_SPIDER : (enemytype < .9f ? Thing::ENEMY_BAT : Thing::ENEMY_GHOST));
+}
+
+static void GenerateWave(WaveLayout& out, int forwave, unsigned int seed)
+{
+	ZL_SeededRand rnd(seed);
+	char* map = out.map;
 	//MAPW = MAPH = newmapsz;
-	Map[MAPW*MAPH] = '\0';
-	memset(Map, TILE_WALL, MAPW*MAPH);
+	map[MAPW*MAPH] = '\0';
+	memset(map, TILE_WALL, MAPW*MAPH);
 
 	for (int i = 0; i != 10; i++)
 	{
-		int emptyX = 1+2*RAND_INT_MAX(MAPW/2-1);//RAND_INT_RANGE(2, MAPW-3);
-		int emptyY = 1+2*RAND_INT_MAX(MAPH/2-1);//RAND_INT_RANGE(2, MAPH-3);
-		Map[emptyX*MAPW+emptyY] = TILE_EMPTY;
+		int emptyX = 1+2*(int)(rnd.UInt()%(MAPW/2));//RAND_INT_RANGE(2, MAPW-3);
+		int emptyY = 1+2*(int)(rnd.UInt()%(MAPH/2));//RAND_INT_RANGE(2, MAPH-3);
+		map[emptyX*MAPW+emptyY] = TILE_EMPTY;
 	}
 
 	for (char empty = 0; empty < 4 - MIN(4/2, 2); empty++)
@@ -199,72 +558,135 @@ static void StartWave()
 		int currentx = MAPW/2|1, currenty = MAPH/2|1;
 		for (int y = currenty - 2; y <= currenty + 2; y++)
 			for (int x = currentx - 2; x <= currentx + 2; x++)
-				Map[y*MAPW+x] = empty;
+				map[y*MAPW+x] = empty;
  
 		REGENERATE:
 		for (int i = 0; i != 100; i++)
 		{
 			int oldx = currentx, oldy = currenty;
-			switch (RAND_INT_MAX(3))
+			switch (rnd.UInt()%4)
 			{
 				case 0: if (currentx < MAPW-2) currentx += 2; break;
 				case 1: if (currenty < MAPH-2) currenty += 2; break;
 				case 2: if (currentx >      2) currentx -= 2; break;
 				case 3: if (currenty >      2) currenty -= 2; break;
 			}
-			if (Map[currenty*MAPW+currentx] == empty) continue;
-			Map[currenty*MAPW+currentx] = empty;
-			Map[((currenty + oldy) / 2)*MAPW+((currentx + oldx) / 2)] = empty;
+			if (map[currenty*MAPW+currentx] == empty) continue;
+			map[currenty*MAPW+currentx] = empty;
+			map[((currenty + oldy) / 2)*MAPW+((currentx + oldx) / 2)] = empty;
 		}
  
 		//check if all cells are visited
 		for (int y = 1; y != MAPH; y += 2)
 			for (int x = 1; x != MAPW; x += 2)
-				if (Map[y*MAPW+x] > TILE_EMPTY) goto REGENERATE;
+				if (map[y*MAPW+x] > TILE_EMPTY) goto REGENERATE;
 	}
 
-	for (char& c : Map) if (c < TILE_EMPTY) c = TILE_EMPTY;
+	for (int i = 0; i != MAXMAPSIZE*MAXMAPSIZE+1; i++) if (map[i] < TILE_EMPTY) map[i] = TILE_EMPTY;
 
 	//clear pillars with nothing around
 	for (int y = 2; y != MAPH - 1; y+=2)
 		for (int x = 2; x != MAPW - 1; x+=2)
-			if (Map[y*MAPW+x] > TILE_EMPTY && Map[y*MAPW+x-1] <= TILE_EMPTY && Map[y*MAPW+x+1] <= TILE_EMPTY && Map[y*MAPW-MAPW+x] <= TILE_EMPTY && Map[y*MAPW+MAPW+x] <= TILE_EMPTY && !RAND_CHANCE(10))
-				Map[y*MAPW+x] =  TILE_EMPTY;
+			if (map[y*MAPW+x] > TILE_EMPTY && map[y*MAPW+x-1] <= TILE_EMPTY && map[y*MAPW+x+1] <= TILE_EMPTY && map[y*MAPW-MAPW+x] <= TILE_EMPTY && map[y*MAPW+MAPW+x] <= TILE_EMPTY && (rnd.UInt()%10))
+				map[y*MAPW+x] =  TILE_EMPTY;
+
+	//inner wall heights below the ground, FadeWalls raises them by the fade amount
+	ZL_SeededRand rndheights((unsigned)forwave);
+	for (int y = 0; y != MAPH; y++)
+		for (int x = 0; x != MAPW; x++)
+			if (x != 0 && x != MAPW-1 && y != 0 && y != MAPH-1 && map[y*MAPW+x] == TILE_WALL)
+				out.wallbase[y*MAPW+x] = rndheights.Range(0.2f, 0.8f) - 1;
+}
+
+static void FinishWavePrep(GameState& g)
+{
+	#ifdef SHOOTZILLA_THREADS
+	std::unique_lock<std::mutex> lock(g.prepmutex);
+	g.prepcond.wait(lock, [&g]() { return !g.prepbusy; });
+	#endif
+}
+
+#ifdef SHOOTZILLA_THREADS
+static void WavePrepMain(GameState* g)
+{
+	std::unique_lock<std::mutex> lock(g->prepmutex);
+	for (;;)
+	{
+		g->prepcond.wait(lock, [g]() { return g->prepbusy || g->prepquit; });
+		if (g->prepquit) return;
+		lock.unlock();
+		GenerateWave(g->prep, g->prepwave, g->prepseed);
+		lock.lock();
+		g->prepbusy = false;
+		g->prepcond.notify_all();
+	}
+}
+#endif
+
+static void PrepareWave(GameState& g, int forwave)
+{
+	FinishWavePrep(g);
+	g.prepwave = forwave;
+	g.prepseed = g.rand.UInt();
+	#ifdef SHOOTZILLA_THREADS
+	if (g.asyncprep)
+	{
+		if (!g.prepthread.joinable()) g.prepthread = std::thread(WavePrepMain, &g);
+		std::lock_guard<std::mutex> lock(g.prepmutex);
+		g.prepbusy = true;
+		g.prepcond.notify_all();
+		return;
+	}
+	#endif
+	GenerateWave(g.prep, g.prepwave, g.prepseed);
+}
 
-	if (wave == 0)
+static void StartWave(GameState& g)
+{
+	FinishWavePrep(g);
+	if (g.prepwave != g.wave) PrepareWave(g, g.wave), FinishWavePrep(g); //not prepared ahead (first wave after loading)
+	memcpy(g.map, g.prep.map, sizeof(g.map));
+	memcpy(g.wallbase, g.prep.wallbase, sizeof(g.wallbase));
+	g.mapversion++;
+	PrepareWave(g, g.wave + 1);
+
+	if (g.wave == 0)
 	{
 		for (int i = 0; i != MAPW*MAPH; i++)
 			if (i < MAPW || i >= MAPW*MAPH-MAPW || (i%MAPW) == 0 || (i%MAPW) == MAPW-1)
-				MapHeights[i] = RAND_RANGE(2.2f, 2.8f);
+				g.heights[i] = g.RandRange(2.2f, 2.8f);
 
 		for (int y = 1; y != MAPH-1; y++)
 			for (int x = 1; x != MAPW-1; x++)
-				Map[x+y*MAPW] = TILE_EMPTY;
+				g.map[x+y*MAPW] = TILE_EMPTY;
 	}
 
 
-	if (!wave) return;
+	if (!g.wave) return;
 
-	wavespawns = 4+(wave-1)*3;
+	g.wavespawns = 4+(g.wave-1)*3;
 }
 
 
-static void Reset()
+static void Reset(GameState& g)
 {
-	gameover = 0;
-	waveticks = 0;
-	wave = 0;
-	kills = 0;
-	StartWave();
-
-	bullets.clear();
-	enemies.clear();
-	player = Player();
-	player.mtx.SetTranslate(MAPW*.5f+.5f, MAPH*.5f+.5f, 0);
-	player.dir = ZLV3(0,1,0);
+	g.gameover = 0;
+	g.waveticks = 0;
+	g.wave = 0;
+	g.kills = 0;
+	g.thingids = 0;
+	StartWave(g);
+
+	g.bullets.clear();
+	g.spiders.clear();
+	g.bats.clear();
+	g.ghosts.clear();
+	g.player = Player();
+	g.player.mtx.SetTranslate(MAPW*.5f+.5f, MAPH*.5f+.5f, 0);
+	g.player.dir = ZLV3(0,1,0);
 }
 
-static ZL_Vector AStarMoveTarget(ZL_Vector from, ZL_Vector to)
+static ZL_Vector AStarMoveTarget(GameState& g, ZL_Vector from, ZL_Vector to)
 {
 	struct SpiralRange
 	{
@@ -297,8 +719,8 @@ static ZL_Vector AStarMoveTarget(ZL_Vector from, ZL_Vector to)
 	int idxFrom = (ifromx + ifromy * MAPW);
 	int idxTo   = (itox   + itoy   * MAPW);
 	if (idxTo == idxFrom) return to;
-	if (Map[idxTo]   == TILE_WALL) { for (int i : SpiralRange(idxTo  )) { if (Map[i] == TILE_EMPTY) { idxTo   = i; break; } } }
-	if (Map[idxFrom] == TILE_WALL) { for (int i : SpiralRange(idxFrom)) { if (Map[i] == TILE_EMPTY) { idxFrom = i; break; } } }
+	if (g.map[idxTo]   == TILE_WALL) { for (int i : SpiralRange(idxTo  )) { if (g.map[i] == TILE_EMPTY) { idxTo   = i; break; } } }
+	if (g.map[idxFrom] == TILE_WALL) { for (int i : SpiralRange(idxFrom)) { if (g.map[i] == TILE_EMPTY) { idxFrom = i; break; } } }
 	if (idxTo == idxFrom) return to;
 
 	int FrontierDone = 0, FrontierCount = 0;
@@ -320,7 +742,7 @@ static ZL_Vector AStarMoveTarget(ZL_Vector from, ZL_Vector to)
 			}
 			if (Visited[idxNeighbor]) continue;
 			Visited[idxNeighbor] = true;
-			if (Map[idxNeighbor] != TILE_EMPTY) continue;
+			if (g.map[idxNeighbor] != TILE_EMPTY) continue;
 			Frontier[FrontierCount++] = idxNeighbor;
 			if (idxNeighbor == idxTo)
 			{
@@ -332,20 +754,20 @@ static ZL_Vector AStarMoveTarget(ZL_Vector from, ZL_Vector to)
 					Path[idx2] = idx1;
 				}
 				int idxTarget = Path[idxFrom]; //[Steps > 1 ? Path[idxFrom] : idxFrom];
+				g.MetricAdd(METRIC_PATH_NODES, FrontierDone);
 				return ZLV((idxTarget%MAPW)+.5f, (idxTarget/MAPW)+.5f);
 			}
 			Path[idxNeighbor] = idx;
 		}
 		InYWall = InXWall = false;
 	}
+	g.MetricAdd(METRIC_PATH_NODES, FrontierDone);
 	return to; //no path
 }
 
-static Thing* DoCollision(Thing& t, float stepHeight)
+static Thing* DoCollision(GameState& g, Thing& t, float stepHeight)
 {
 	struct Col { ZL_Vector3 pos, dir; Thing* what; float dist; };
-	static std::vector<Col> cols;
-	cols.clear();
 	ZL_Vector3 tpos = t.mtx.GetTranslate();
 	if (tpos.z < -10 || tpos.z > 20)
 	{
@@ -353,63 +775,83 @@ static Thing* DoCollision(Thing& t, float stepHeight)
 		return &world;
 	}
 
+	// candidates are collected in the frame arena, at most 5 per tile of the 3x3 around, the ground, all enemies and the player
+	// ReservePools sizes the arena for full pools so this can't run out, a game that never reserved has no enemies to add
+	static_assert(sizeof(Col) <= COLLISION_COL_BYTES, "tick arena is sized for smaller collision candidates");
+	enum { FALLBACK_COLS = COLLISION_WORLD_COLS + 32 };
+	size_t arenamark = g.arena.Mark();
+	int maxcols = COLLISION_WORLD_COLS + (t.type == Thing::ENEMY_SPIDER ? EnemyCount(g) : 0);
+	Col* cols = g.arena.Alloc<Col>(maxcols);
+	alignas(Col) unsigned char fallback[sizeof(Col) * FALLBACK_COLS];
+	if (!cols)
+	{
+		// should the arena still be exhausted the world collides from the stack buffer and only the enemy candidates are limited
+		g.MetricAdd(METRIC_ARENA_OVERFLOWS);
+		cols = (Col*)fallback;
+		maxcols = FALLBACK_COLS;
+	}
+	int numcols = 0;
+
 	int xfrom = ZL_Math::Clamp((int)sfloor(tpos.x - 1.0f), 0, (int)MAPW), xto = ZL_Math::Clamp((int)sfloor(tpos.x + 1.0f), 0, (int)MAPW);
 	int yfrom = ZL_Math::Clamp((int)sfloor(tpos.y - 1.0f), 0, (int)MAPH), yto = ZL_Math::Clamp((int)sfloor(tpos.y + 1.0f), 0, (int)MAPH);
 	for (int y = yfrom ; y <= yto; y++)
 		for (int x = xfrom ; x <= xto; x++)
 		{
 			int ti = (x + y * MAPW);
-			if (Map[ti] == TILE_EMPTY)
+			if (g.map[ti] == TILE_EMPTY)
 			{
 				continue;
 			}
-			if (stepHeight) cols.push_back({ZLV3(x+0.5f, y+0.5f, MapHeights[ti]), ZLV3(0,0,1), &world});
-			if (tpos.z < MapHeights[ti] - stepHeight)
+			if (stepHeight) cols[numcols++] = Col{ZLV3(x+0.5f, y+0.5f, g.heights[ti]), ZLV3(0,0,1), &world};
+			if (tpos.z < g.heights[ti] - stepHeight)
 			{
-				if (tpos.x > s(x + 1)) cols.push_back({ZLV3(x+1.0f, y+0.5f, MapHeights[ti]), ZLV3( 1,0,0), &world});
-				if (tpos.x < s(x    )) cols.push_back({ZLV3(x+0.0f, y+0.5f, MapHeights[ti]), ZLV3(-1,0,0), &world});
-				if (tpos.y > s(y + 1)) cols.push_back({ZLV3(x+0.5f, y+1.0f, MapHeights[ti]), ZLV3(0, 1,0), &world});
-				if (tpos.y < s(y    )) cols.push_back({ZLV3(x+0.5f, y+0.0f, MapHeights[ti]), ZLV3(0,-1,0), &world});
+				if (tpos.x > s(x + 1)) cols[numcols++] = Col{ZLV3(x+1.0f, y+0.5f, g.heights[ti]), ZLV3( 1,0,0), &world};
+				if (tpos.x < s(x    )) cols[numcols++] = Col{ZLV3(x+0.0f, y+0.5f, g.heights[ti]), ZLV3(-1,0,0), &world};
+				if (tpos.y > s(y + 1)) cols[numcols++] = Col{ZLV3(x+0.5f, y+1.0f, g.heights[ti]), ZLV3(0, 1,0), &world};
+				if (tpos.y < s(y    )) cols[numcols++] = Col{ZLV3(x+0.5f, y+0.0f, g.heights[ti]), ZLV3(0,-1,0), &world};
 			}
 		}
 
 	// ground collision
-	cols.push_back({ZLV3(tpos.x, tpos.y, 0), ZLV3(0,0,1), &world});
+	cols[numcols++] = Col{ZLV3(tpos.x, tpos.y, 0), ZLV3(0,0,1), &world};
 
 	if (t.type == Thing::ENEMY_SPIDER)
 	{
-		for (Enemy& e : enemies)
+		ForEachEnemy(g, [&](Enemy& e)
 		{
-			if (&e == &t) continue;
+			if (&e == &t) return;
 			ZL_Vector d = tpos.ToXY() - e.mtx.GetTranslateXY();
 			float dist = d.GetLengthSq();
-			if (dist > ZL_Math::Square(e.radius + t.radius + .25f)) continue;
-			if (dist < 0.01f) continue; // too close to fix
+			if (dist > ZL_Math::Square(e.radius + t.radius + .25f)) return;
+			if (dist < 0.01f) return; // too close to fix
+			if (numcols >= maxcols - 1) return; //keep room for the player
 			ZL_Vector dir = d.Norm();
-			cols.push_back({e.mtx.GetTranslate() + ZL_Vector3(dir*e.radius, 1.0f), ZL_Vector3(dir), &e});
-		}
+			cols[numcols++] = Col{e.mtx.GetTranslate() + ZL_Vector3(dir*e.radius, 1.0f), ZL_Vector3(dir), &e};
+		});
 	}
 	if (t.type == Thing::ENEMY_SPIDER) //(&player != &t)
 	{
-		ZL_Vector d = tpos.ToXY() - player.mtx.GetTranslateXY();
+		ZL_Vector d = tpos.ToXY() - g.player.mtx.GetTranslateXY();
 		float dist = d.GetLengthSq();
-		if (dist < ZL_Math::Square(player.radius + t.radius + .25f) && dist >= 0.01f)
+		if (dist < ZL_Math::Square(g.player.radius + t.radius + .25f) && dist >= 0.01f)
 		{
 			ZL_Vector dir = d.Norm();
-			cols.push_back({player.mtx.GetTranslate() + ZL_Vector3(dir*player.radius, 1.0f), ZL_Vector3(dir), &player});
+			cols[numcols++] = Col{g.player.mtx.GetTranslate() + ZL_Vector3(dir*g.player.radius, 1.0f), ZL_Vector3(dir), &g.player};
 		}
 	}
 
-	for (Col& c : cols)
-		c.dist = tpos.GetDistanceSq(c.pos);
+	g.MetricAdd(METRIC_COLLISION_CANDIDATES, numcols);
+	for (int i = 0; i != numcols; i++)
+		cols[i].dist = tpos.GetDistanceSq(cols[i].pos);
 
 	// because all our collision rects have the same size, we can just sort by closest center
-	sort(cols.begin(), cols.end(), [](const Col& a, const Col& b) { return a.dist < b.dist; });
+	std::sort(cols, cols + numcols, [](const Col& a, const Col& b) { return a.dist < b.dist; });
 
 	Thing* collided = NULL;
 	float radiusPlusHalf = (t.radius+.5f), radiusPlusHalfSq = (radiusPlusHalf*radiusPlusHalf);
-	for (Col& c : cols)
+	for (int i = 0; i != numcols; i++)
 	{
+		Col& c = cols[i];
 		if (tpos.z >= c.pos.z) continue;
 		c.dist = (tpos - c.pos) | c.dir;
 		if (c.dist > t.radius) continue;
@@ -441,10 +883,11 @@ static Thing* DoCollision(Thing& t, float stepHeight)
 	if (tpos.x > MAPW) { tpos.x = (float)MAPW; collided = &world; }
 	if (tpos.y > MAPH) { tpos.y = (float)MAPH; collided = &world; }
 	if (collided) t.mtx.SetTranslate(tpos);
+	g.arena.Release(arenamark);
 	return collided;
 }
 
-static Thing* DoMove(Thing& t, float dt, float stepHeight = 0)
+static Thing* DoMove(GameState& g, Thing& t, float dt, float stepHeight = 0)
 {
 	ZL_Vector3 movetotal = t.vel * dt;
 	float movelen = movetotal.GetLength();
@@ -455,250 +898,1525 @@ static Thing* DoMove(Thing& t, float dt, float stepHeight = 0)
 		for (float step; (step = ZL_Math::Min(movelen, .2f)) > 0; movelen -= step)
 		{
 			t.mtx.TranslateBy(movedir * step);
-			collided = DoCollision(t, stepHeight);
+			collided = DoCollision(g, t, stepHeight);
 		}
 	}
 	return collided;
 }
 
-static void Load()
+struct RayHit
 {
-	fntMain = ZL_Font("Data/typomoderno.ttf.zip", 20.f);
-	fntBig = ZL_Font("Data/typomoderno.ttf.zip", 50.f);
-	fntTitle = ZL_Font("Data/typomoderno.ttf.zip", 100.f);
-	srfCrosshair = ZL_Surface("Data/crosshair.png").SetOrigin(ZL_Origin::Center);
-
-	LightSun.SetSpotLight(50, 1.0f);
+	ZL_Vector3 pos;
+	float dist;
+	Thing* what;
+};
 
-	LightPlayer.SetColor(ZLRGB(.7,.7,.7));
-	LightPlayer.SetFalloff(5);
+// Walk the tiles along the ray (DDA) and test walls as columns up to their height, then test enemies as spheres enlarged by radius
+static bool RayCast(GameState& g, const ZL_Vector3& from, const ZL_Vector3& dir, float maxdist, RayHit& hit, bool hitenemies = true, float radius = 0)
+{
+	hit.what = NULL;
+	hit.dist = maxdist;
+	if (dir.z < 0 && -from.z / dir.z < hit.dist) { hit.dist = -from.z / dir.z; hit.what = &world; }
+
+	int x = (int)sfloor(from.x), y = (int)sfloor(from.y), stepx = (dir.x > 0 ? 1 : -1), stepy = (dir.y > 0 ? 1 : -1);
+	float tdeltax = (dir.x ? sabs(1 / dir.x) : 1e30f), tdeltay = (dir.y ? sabs(1 / dir.y) : 1e30f);
+	float tmaxx = (dir.x ? (dir.x > 0 ? x + 1 - from.x : from.x - x) * tdeltax : 1e30f);
+	float tmaxy = (dir.y ? (dir.y > 0 ? y + 1 - from.y : from.y - y) * tdeltay : 1e30f);
+	for (float tenter = 0; tenter < hit.dist && x >= 0 && y >= 0 && x < MAPW && y < MAPH;)
+	{
+		float texit = ZL_Math::Min(tmaxx, tmaxy);
+		int ti = x + y * MAPW;
+		if (g.map[ti] != TILE_EMPTY)
+		{
+			float h = g.heights[ti], t = -1;
+			if (from.z + dir.z * tenter <= h) t = tenter; //side
+			else if (from.z + dir.z * texit <= h) t = (h - from.z) / dir.z; //top
+			if (t >= 0 && t < hit.dist) { hit.dist = t; hit.what = &world; break; }
+		}
+		if (tmaxx < tmaxy) { x += stepx; tenter = tmaxx; tmaxx += tdeltax; }
+		else               { y += stepy; tenter = tmaxy; tmaxy += tdeltay; }
+	}
 
-	using namespace ZL_MaterialModes;
+	if (hitenemies)
+	{
+		ForEachEnemy(g, [&](Enemy& e)
+		{
+			ZL_Vector3 oc = e.mtx.GetTranslate() - from;
+			float tca = (oc | dir), rsq = ZL_Math::Square(e.radius + radius);
+			float dsq = oc.GetLengthSq() - tca * tca;
+			if (tca < 0 || dsq > rsq) return;
+			float t = ZL_Math::Max(tca - ssqrt(rsq - dsq), 0.0f);
+			if (t < hit.dist) { hit.dist = t; hit.what = &e; }
+		});
+	}
+	if (hit.what) hit.pos = from + dir * hit.dist;
+	return (hit.what != NULL);
+}
 
-	ZL_Material MatGround = ZL_Material(MM_DIFFUSEMAP).SetDiffuseTexture(ZL_Surface("Data/ground.png").SetTextureRepeatMode());
-	MeshGround = ZL_Mesh::BuildPlane(ZLV(MAPW*.5, MAPH*.5), MatGround, ZL_Vector3::Up, ZLV3(MAPW*.5, MAPH*.5, 0), ZLV(MAPW, MAPH));
+static bool HasLineOfSight(GameState& g, const ZL_Vector3& from, const ZL_Vector3& to)
+{
+	RayHit hit;
+	ZL_Vector3 d = to - from;
+	float dist = d.GetLength();
+	return (dist < 0.001f || !RayCast(g, from, d / dist, dist, hit, false));
+}
 
-	ZL_Material MatWall = ZL_Material(MM_DIFFUSEMAP).SetDiffuseTexture(ZL_Surface("Data/wall.png").SetTextureRepeatMode().SetScale(.1f));
-	MeshWall = ZL_Mesh::FromPLY("Data/wall.ply", MatWall);
-	//MeshWall = ZL_Mesh::BuildBox(ZLV3(.5, .5, 2), MatWall, ZLV3(0,0,-2), ZLV(1,3));
+// Compact world snapshots: positions on a 1/256 tile grid, velocities and health in small fixed point fields
+// Snapshots are delta encoded against a baseline the receiver has acknowledged, unchanged things are not written at all
+enum { SNAP_X, SNAP_Y, SNAP_Z, SNAP_VX, SNAP_VY, SNAP_VZ, SNAP_HEALTH, SNAP_FIELDS };
+static const int SnapFieldBits[SNAP_FIELDS] = { 13, 13, 12, 11, 11, 11, 10 };
+static const bool SnapFieldSigned[SNAP_FIELDS] = { false, false, false, true, true, true, false };
 
-	MeshSpider = ZL_Mesh::BuildPlane(ZLV(.3,.3), ZL_Material(MM_DIFFUSEMAP|MO_MASKED).SetDiffuseTexture(ZL_Surface("Data/spider.png")));
-	MeshBat = ZL_Mesh::BuildPlane(ZLV(.3,.3), ZL_Material(MM_DIFFUSEMAP|MO_MASKED).SetDiffuseTexture(ZL_Surface("Data/bat.png")));
-	MeshGhost = ZL_Mesh::BuildPlane(ZLV(.5,.5), ZL_Material(MM_DIFFUSEMAP|MO_MASKED).SetDiffuseTexture(ZL_Surface("Data/ghost.png")));
+struct SnapThing
+{
+	unsigned int id;
+	unsigned char type;
+	short f[SNAP_FIELDS];
+	bool operator==(const SnapThing& o) const { return id == o.id && type == o.type && !memcmp(f, o.f, sizeof(f)); }
+	bool operator!=(const SnapThing& o) const { return !(*this == o); }
+};
 
-	//MeshBullet = ZL_Mesh::BuildSphere(.1f, 5);
-	MeshBullet = ZL_Mesh::BuildPlane(ZLV(.1,.1), ZL_Material(MM_DIFFUSEMAP|MO_UNLIT|MO_MASKED|MO_CASTNOSHADOW).SetDiffuseTexture(ZL_Surface("Data/spark.png")));
+struct Snapshot
+{
+	unsigned int tick = 0;
+	SnapThing player = { 0, Thing::PLAYER, {0} };
+	std::vector<SnapThing> things; //sorted by id
+};
 
-	ParticleDamage = ZL_ParticleEmitter(.5f, 500, OP_TRANSPARENT);
-	ParticleDamage.SetTexture(ZL_Surface("Data/particle.png"), 1, 1);
-	ParticleDamage.SetLifetimeSize(.5f, .05f);
-	ParticleDamage.SetSpawnVelocityRanges(ZLV3(-.6,-.6,.1), ZLV3(.6,.6,.6));
-	ParticleDamage.SetSpawnColorRange(ZLRGB(.1,.1,.5), ZLRGB(.5,.5,.9));
-	ParticleDamage.SetLifetimeAlpha(.3f, 0);
+struct BitWriter
+{
+	BitWriter(std::vector<unsigned char>& out) : out(out) { out.clear(); }
+	~BitWriter() { if (n) out.push_back((unsigned char)acc); }
+	void Write(unsigned int v, int bits)
+	{
+		acc |= (unsigned long long)(v & (unsigned int)((1ull<<bits)-1)) << n;
+		for (n += bits; n >= 8; n -= 8, acc >>= 8) out.push_back((unsigned char)acc);
+	}
+	std::vector<unsigned char>& out;
+	unsigned long long acc = 0;
+	int n = 0;
+};
 
-	ParticleDestroy = ZL_ParticleEmitter(1.5f, 500, OP_TRANSPARENT);
-	ParticleDestroy.SetTexture(ZL_Surface("Data/particle.png"), 1, 1);
-	ParticleDestroy.SetLifetimeSize(.5f, .05f);
-	ParticleDestroy.SetSpawnVelocityRanges(ZLV3(-.2,-.2,1), ZLV3(.2,.2,2));
-	ParticleDestroy.SetLifetimeAlpha(.3f, 0);
+struct BitReader
+{
+	BitReader(const unsigned char* p, size_t size) : p(p), end(p+size) {}
+	unsigned int Read(int bits)
+	{
+		for (; n < bits; n += 8)
+		{
+			if (p == end) { overflow = true; return 0; }
+			acc |= (unsigned long long)*(p++) << n;
+		}
+		unsigned int v = (unsigned int)(acc & ((1ull<<bits)-1));
+		acc >>= bits, n -= bits;
+		return v;
+	}
+	const unsigned char *p, *end;
+	unsigned long long acc = 0;
+	int n = 0;
+	bool overflow = false;
+};
 
-	#ifdef ZILLALOG
-	MeshDbgCollision = ZL_Mesh::BuildPlane(ZLV(.3,.3));
-	MeshDbgSphere = ZL_Mesh::FromPLY("work/sphere.ply");
-	#endif
+static short SnapQuantize(float v, float scale, int bits, bool sign)
+{
+	int hi = (sign ? (1<<(bits-1)) : (1<<bits)) - 1, lo = (sign ? -hi-1 : 0);
+	return (short)ZL_Math::Clamp((int)sfloor(v * scale + .5f), lo, hi);
+}
 
-	extern TImcSongData imcDataIMCMUSIC, imcDataIMCBULLET, imcDataIMCHIT, imcDataIMCHIT2, imcDataIMCJUMP;
-	sndBullet = ZL_SynthImcTrack::LoadAsSample(&imcDataIMCBULLET);
-	sndHit = ZL_SynthImcTrack::LoadAsSample(&imcDataIMCHIT);
-	sndHit2 = ZL_SynthImcTrack::LoadAsSample(&imcDataIMCHIT2);
-	sndJump = ZL_SynthImcTrack::LoadAsSample(&imcDataIMCJUMP);
-	imcMusic = ZL_SynthImcTrack(&imcDataIMCMUSIC);
-	imcMusic.Play();
+static SnapThing SnapCapture(const Thing& t, float health)
+{
+	ZL_Vector3 pos = t.mtx.GetTranslate();
+	SnapThing st = { t.id, (unsigned char)t.type, {0} };
+	st.f[SNAP_X] = SnapQuantize(pos.x, 256, SnapFieldBits[SNAP_X], false);
+	st.f[SNAP_Y] = SnapQuantize(pos.y, 256, SnapFieldBits[SNAP_Y], false);
+	st.f[SNAP_Z] = SnapQuantize(pos.z + 4, 256, SnapFieldBits[SNAP_Z], false);
+	st.f[SNAP_VX] = SnapQuantize(t.vel.x, 64, SnapFieldBits[SNAP_VX], true);
+	st.f[SNAP_VY] = SnapQuantize(t.vel.y, 64, SnapFieldBits[SNAP_VY], true);
+	st.f[SNAP_VZ] = SnapQuantize(t.vel.z, 64, SnapFieldBits[SNAP_VZ], true);
+	st.f[SNAP_HEALTH] = SnapQuantize(health, 8, SnapFieldBits[SNAP_HEALTH], false);
+	return st;
+}
 
+static void SnapshotCapture(GameState& g, Snapshot& snap, unsigned int tick)
+{
+	snap.tick = tick;
+	snap.player = SnapCapture(g.player, g.player.health);
+	snap.things.clear();
+	for (Bullet& b : g.bullets) snap.things.push_back(SnapCapture(b, 0));
+	ForEachEnemy(g, [&](Enemy& e) { snap.things.push_back(SnapCapture(e, e.health)); });
+	sort(snap.things.begin(), snap.things.end(), [](const SnapThing& a, const SnapThing& b) { return a.id < b.id; });
 }
 
-static int CalcAttackCount(float dt, float& timer, float delay, bool attacking)
+static void SnapWriteThing(BitWriter& bw, const SnapThing& base, const SnapThing& cur)
 {
-	int n = 0;
-	for (float dtx = dt, dtstep; (dtstep = ZL_Math::Min(dtx, delay)) > 0; dtx -= dtstep)
+	for (int i = 0; i != SNAP_FIELDS; i++)
 	{
-		timer += dtstep;
-		if (!attacking) continue;
-		if (timer > 0) timer = 0;
-		if (timer < 0) continue;
-		timer -= delay;
-		n++;
+		int d = cur.f[i] - base.f[i];
+		bw.Write(d != 0, 1);
+		if (!d) continue;
+		bool small = (d >= -128 && d <= 127);
+		bw.Write(small, 1);
+		if (small) bw.Write((unsigned int)d, 8);
+		else bw.Write((unsigned int)cur.f[i], SnapFieldBits[i]);
 	}
-	return n;
 }
 
-static void Update(float dt)
+static void SnapReadThing(BitReader& br, const SnapThing& base, SnapThing& cur)
 {
-	if (IsTitle) return;
-	ZL_Vector md = ZL_Input::MouseDelta();
+	for (int i = 0; i != SNAP_FIELDS; i++)
+	{
+		cur.f[i] = base.f[i];
+		if (!br.Read(1)) continue;
+		if (br.Read(1)) cur.f[i] = (short)(base.f[i] + (signed char)br.Read(8));
+		else
+		{
+			int v = (int)br.Read(SnapFieldBits[i]);
+			if (SnapFieldSigned[i] && (v & (1<<(SnapFieldBits[i]-1)))) v -= (1<<SnapFieldBits[i]);
+			cur.f[i] = (short)v;
+		}
+	}
+}
 
-	if (player.health <= 0) return;
+enum { SNAPOP_END, SNAPOP_CHANGE, SNAPOP_NEW, SNAPOP_REMOVE };
 
-	if (md.x || md.y)
+static void SnapWriteOp(BitWriter& bw, int op, unsigned int id, unsigned int& lastid)
+{
+	unsigned int gap = id - lastid;
+	bw.Write(op, 2);
+	bw.Write(gap < 64, 1);
+	if (gap < 64) bw.Write(gap, 6);
+	else { bw.Write(gap < 65536, 1); bw.Write(gap, (gap < 65536 ? 16 : 32)); }
+	lastid = id;
+}
+
+static void SnapshotEncode(const Snapshot& base, const Snapshot& cur, std::vector<unsigned char>& out)
+{
+	BitWriter bw(out);
+	bw.Write(cur.tick, 32);
+	bw.Write(base.tick, 32);
+	bw.Write(cur.player != base.player, 1);
+	if (cur.player != base.player) SnapWriteThing(bw, base.player, cur.player);
+
+	static const SnapThing empty = { 0, 0, {0} };
+	unsigned int lastid = 0;
+	for (size_t ib = 0, ic = 0; ib != base.things.size() || ic != cur.things.size();)
 	{
-		ZL_Vector3 curdir = player.dir.VecNorm();
-		ZL_Vector3 forward = ZL_Vector3(curdir.ToXY().Norm(), 0);
-		ZL_Vector3 right = ZL_Vector3(forward.ToXY().RPerp());
-		float pitch = curdir.GetRelAbsAngle(forward) * (curdir.z < 0 ? -1 : 1);
-		float newpitch = ZL_Math::Clamp(pitch + md.y * SPEED_PITCH, -PIHALF*0.99f, PIHALF*0.99f);
-		player.dir.Rotate(right, newpitch - pitch);
-		player.dir.Rotate(ZL_Vector3::Up, -md.x * SPEED_YAW);
-		player.dir.Norm();
+		const SnapThing* b = (ib != base.things.size() ? &base.things[ib] : NULL);
+		const SnapThing* c = (ic != cur.things.size() ? &cur.things[ic] : NULL);
+		if (b && (!c || b->id < c->id || (b->id == c->id && b->type != c->type))) { SnapWriteOp(bw, SNAPOP_REMOVE, b->id, lastid); ib++; }
+		else if (!b || c->id != b->id) { SnapWriteOp(bw, SNAPOP_NEW, c->id, lastid); bw.Write(c->type, 3); SnapWriteThing(bw, empty, *c); ic++; }
+		else
+		{
+			if (*b != *c) { SnapWriteOp(bw, SNAPOP_CHANGE, c->id, lastid); SnapWriteThing(bw, *b, *c); }
+			ib++, ic++;
+		}
 	}
+	bw.Write(SNAPOP_END, 2);
+}
 
-	ZL_Vector wasd = ZLV(((ZL_Input::Held(ZLK_D) || ZL_Input::Held(ZLK_RIGHT)) ? 1.0f : ((ZL_Input::Held(ZLK_A) || ZL_Input::Held(ZLK_LEFT)) ? -1.0f : 0)), 
-	                     ((ZL_Input::Held(ZLK_W) || ZL_Input::Held(ZLK_UP   )) ? 1.0f : ((ZL_Input::Held(ZLK_S) || ZL_Input::Held(ZLK_DOWN)) ? -1.0f : 0)));
-
-	bool fire = (!!ZL_Input::Held(ZL_BUTTON_LEFT));
-	for (int i = CalcAttackCount(dt, player.weapontimer, WEAPON_DELAY, fire); i--;)
+static bool SnapshotDecode(const Snapshot& base, const unsigned char* data, size_t size, Snapshot& out)
+{
+	BitReader br(data, size);
+	out.tick = br.Read(32);
+	if (br.Read(32) != base.tick) return false;
+	out.player = base.player;
+	if (br.Read(1)) SnapReadThing(br, base.player, out.player);
+
+	static const SnapThing empty = { 0, 0, {0} };
+	out.things.clear();
+	size_t ib = 0;
+	for (unsigned int id = 0;;)
 	{
-		Bullet b;
-		b.mtx = ZL_Matrix::MakeTranslate(player.mtx.GetTranslate() + ZLV3(0, 0, VIEW_HEIGHT*.8f));
-		b.vel = player.dir * BULLET_SPEED;
-		b.vel.z += 0.1f;
-		bullets.push_back(b);
-		sndBullet.Play();
+		int op = (int)br.Read(2);
+		if (op == SNAPOP_END || br.overflow) break;
+		id += br.Read(br.Read(1) ? 6 : (br.Read(1) ? 16 : 32));
+		while (ib != base.things.size() && base.things[ib].id < id) out.things.push_back(base.things[ib++]);
+		bool inbase = (ib != base.things.size() && base.things[ib].id == id);
+		if (op == SNAPOP_NEW)
+		{
+			if (inbase) return false;
+			SnapThing st = { id, (unsigned char)br.Read(3), {0} };
+			SnapReadThing(br, empty, st);
+			out.things.push_back(st);
+			continue;
+		}
+		if (!inbase) return false;
+		if (op == SNAPOP_CHANGE)
+		{
+			SnapThing st = base.things[ib];
+			SnapReadThing(br, base.things[ib], st);
+			out.things.push_back(st);
+		}
+		ib++;
 	}
+	while (ib != base.things.size()) out.things.push_back(base.things[ib++]);
+	return !br.overflow;
+}
+
+static void WarmUpDraw()
+{
+	double start = TimeMs();
+	ZL_Camera cam;
+	cam.SetLookAt(ZLV3(.5f, -1.5f, 1.5f), ZLV3(.5f, .5f, .5f));
+	LightSun.SetLookAt(ZLV3(-5, -5, 10), ZLV3(.5f, .5f, 0));
+	LightPlayer.SetPosition(cam.GetPosition());
+
+	// the particles are spawned inside the border wall at the map corner where they expire unseen
+	ParticleDamage.Spawn(ZLV3(.5f, .5f, .5f));
+	ParticleDestroy.Spawn(ZLV3(.5f, .5f, .5f));
+	ParticleDamage.Update(cam);
+	ParticleDestroy.Update(cam);
+
+	ZL_RenderList list, *lists[] = { &list };
+	const ZL_Mesh* meshes[] = { &MeshGround, &MeshWall, &MeshWallLod, &MeshBullet, &MeshSpider, &MeshBat, &MeshGhost, &MeshSpiderNoShadow, &MeshBatNoShadow, &MeshGhostNoShadow };
+	for (const ZL_Mesh* mesh : meshes) list.Add(*mesh, ZL_Matrix::MakeTranslate(ZLV3(.5f, .5f, .5f)));
+	list.Add(ParticleDamage, ZL_Matrix::Identity);
+	list.Add(ParticleDestroy, ZL_Matrix::Identity);
+
+	// the target surface has no depth buffer, which does not matter as the draw only needs to prepare the shaders and buffers
+	ZL_Surface target(256, 256);
+	target.RenderToBegin(true);
+	ZL_Display3D::DrawListsWithLights(lists, COUNT_OF(lists), cam, Lights, COUNT_OF(Lights));
+	srfCrosshair.Draw(128, 128);
+	srfMinimap.Draw(0, 0);
+	target.RenderToEnd();
+	WarmUp.ms = (float)(TimeMs() - start);
+}
 
-	if ((ZL_Input::Down(ZLK_SPACE) || ZL_Input::Down(ZL_BUTTON_RIGHT)) && player.jumps)
+// Assets are loaded in small steps between the frames of the title screen while the sounds are synthesized on a worker thread (or one per frame without threads)
+enum { LOAD_FONTS, LOAD_GROUND, LOAD_WALLS, LOAD_ENEMIES, LOAD_BULLET, LOAD_PARTICLES, LOAD_SOUNDS, LOAD_WARMUP, LOAD_DONE };
+static struct sAssetLoad
+{
+	int step = LOAD_FONTS;
+	double start = 0;
+	bool firstframe = false;
+	#ifdef SHOOTZILLA_THREADS
+	std::atomic<bool> synthesized;
+	std::thread synth;
+	~sAssetLoad() { if (synth.joinable()) synth.join(); }
+	#else
+	int synthstep = 0; //without threads one sound is synthesized per frame
+	#endif
+} AssetLoad;
+
+enum { SYNTH_BULLET, SYNTH_HIT, SYNTH_HIT2, SYNTH_JUMP, SYNTH_MUSIC, SYNTH_COUNT };
+static void SynthesizeSound(int which)
+{
+	extern TImcSongData imcDataIMCMUSIC, imcDataIMCBULLET, imcDataIMCHIT, imcDataIMCHIT2, imcDataIMCJUMP;
+	switch (which)
 	{
-		player.jumps--;
-		player.vel.z = JUMP_STRENGTH;
-		sndJump.Play();
+		case SYNTH_BULLET: sndBullet = ZL_SynthImcTrack::LoadAsSample(&imcDataIMCBULLET); break;
+		case SYNTH_HIT:    sndHit = ZL_SynthImcTrack::LoadAsSample(&imcDataIMCHIT); break;
+		case SYNTH_HIT2:   sndHit2 = ZL_SynthImcTrack::LoadAsSample(&imcDataIMCHIT2); break;
+		case SYNTH_JUMP:   sndJump = ZL_SynthImcTrack::LoadAsSample(&imcDataIMCJUMP); break;
+		case SYNTH_MUSIC:  imcMusic = ZL_SynthImcTrack(&imcDataIMCMUSIC); break;
 	}
-	ZL_Vector forward2d = player.dir.ToXY().Norm();
-	ZL_Vector right2d = forward2d.VecRPerp();
-	ZL_Vector move = forward2d * (wasd.y * SPEED_FORWARD) + right2d * (wasd.x * SPEED_STRAFE);
-	float newvelz = player.vel.z + dt*SPEED_GRAV;
-	player.vel = ZL_Vector3::Lerp(player.vel, move, dt*(player.vel.z ? SPEED_AIRACCEL : SPEED_ACCEL));
-	player.vel.z = newvelz;
+}
+
+#ifdef SHOOTZILLA_THREADS
+static void SynthesizeSounds()
+{
+	for (int i = 0; i != SYNTH_COUNT; i++) SynthesizeSound(i);
+	AssetLoad.synthesized = true;
+}
+#endif
 
-	DoMove(player, dt, CAN_STEP_HEIGHT);
-	if (player.vel.z == 0) player.jumps = 2;
+static bool AssetsLoaded()
+{
+	return AssetLoad.step == LOAD_DONE;
+}
 
-	for (size_t i = 0; i != bullets.size(); i++)
+static void LoadStep()
+{
+	using namespace ZL_MaterialModes;
+	switch (AssetLoad.step++)
 	{
-		Bullet& b = bullets[i];
-		if (DoMove(b, dt))
+		case LOAD_FONTS:
 		{
-			bullets.erase(bullets.begin()+(i--));
-			continue;
+			fntMain = ZL_Font("Data/typomoderno.ttf.zip", 20.f);
+			fntBig = ZL_Font("Data/typomoderno.ttf.zip", 50.f);
+			fntTitle = ZL_Font("Data/typomoderno.ttf.zip", 100.f);
+			#ifdef SHOOTZILLA_THREADS
+			AssetLoad.synth = std::thread(SynthesizeSounds);
+			#endif
+			break;
 		}
-
-		for (Enemy& e : enemies)
+		case LOAD_GROUND:
 		{
-			float distSq = e.mtx.GetTranslate().GetDistanceSq(b.mtx.GetTranslate());
-			if (distSq > ZL_Math::Square(e.radius + b.radius)) continue;
+			srfCrosshair = ZL_Surface("Data/crosshair.png").SetOrigin(ZL_Origin::Center);
 
-			ZL_Vector3 epos = e.mtx.GetTranslate();
-			float erad = e.radius * .5f;
+			LightSun.SetSpotLight(50, 1.0f);
 
-			if ((e.health -= 1) <= 0)
-			{
-				sndHit2.Play();
-				for (int pn = 0; pn != 200; pn++)
-				{
-					ParticleDestroy.SetColor(RAND_COLOR, false);
-					ParticleDestroy.Spawn(ZLV3(RAND_RANGE(epos.x-erad, epos.x+erad), RAND_RANGE(epos.y-erad, epos.y+erad), RAND_RANGE(epos.z-erad, epos.z+erad)));
-				}
-				enemies.erase(enemies.begin() + ((Enemy*)&e - &enemies[0]));
-				kills++;
-			}
-			else
+			LightPlayer.SetColor(ZLRGB(.7,.7,.7));
+			LightPlayer.SetFalloff(5);
+
+			ZL_Material MatGround = ZL_Material(MM_DIFFUSEMAP).SetDiffuseTexture(ZL_Surface("Data/ground.png").SetTextureRepeatMode());
+			MeshGround = ZL_Mesh::BuildPlane(ZLV(MAPW*.5, MAPH*.5), MatGround, ZL_Vector3::Up, ZLV3(MAPW*.5, MAPH*.5, 0), ZLV(MAPW, MAPH));
+			break;
+		}
+		case LOAD_WALLS:
+		{
+			ZL_Material MatWall = ZL_Material(MM_DIFFUSEMAP).SetDiffuseTexture(ZL_Surface("Data/wall.png").SetTextureRepeatMode().SetScale(.1f));
+			MeshWall = ZL_Mesh::FromPLY("Data/wall.ply", MatWall);
+			//MeshWall = ZL_Mesh::BuildBox(ZLV3(.5, .5, 2), MatWall, ZLV3(0,0,-2), ZLV(1,3));
+			MeshWallLod = ZL_Mesh::BuildBox(ZLV3(.54, .54, 2.5), MatWall, ZLV3(0,0,-2.5), ZLV(1,4)); //outer bounds of wall.ply (x/y +-0.54, z -5 to the +-0.04 bumps of the top)
+			break;
+		}
+		case LOAD_ENEMIES:
+		{
+			ZL_Surface srfSpider("Data/spider.png"), srfBat("Data/bat.png"), srfGhost("Data/ghost.png");
+			MeshSpider = ZL_Mesh::BuildPlane(ZLV(.3,.3), ZL_Material(MM_DIFFUSEMAP|MO_MASKED).SetDiffuseTexture(srfSpider));
+			MeshBat = ZL_Mesh::BuildPlane(ZLV(.3,.3), ZL_Material(MM_DIFFUSEMAP|MO_MASKED).SetDiffuseTexture(srfBat));
+			MeshGhost = ZL_Mesh::BuildPlane(ZLV(.5,.5), ZL_Material(MM_DIFFUSEMAP|MO_MASKED).SetDiffuseTexture(srfGhost));
+			MeshSpiderNoShadow = ZL_Mesh::BuildPlane(ZLV(.3,.3), ZL_Material(MM_DIFFUSEMAP|MO_MASKED|MO_CASTNOSHADOW).SetDiffuseTexture(srfSpider));
+			MeshBatNoShadow = ZL_Mesh::BuildPlane(ZLV(.3,.3), ZL_Material(MM_DIFFUSEMAP|MO_MASKED|MO_CASTNOSHADOW).SetDiffuseTexture(srfBat));
+			MeshGhostNoShadow = ZL_Mesh::BuildPlane(ZLV(.5,.5), ZL_Material(MM_DIFFUSEMAP|MO_MASKED|MO_CASTNOSHADOW).SetDiffuseTexture(srfGhost));
+			break;
+		}
+		case LOAD_BULLET:
+		{
+			srfMinimap = ZL_Surface(MAPW*16, MAPH*16);
+
+			//MeshBullet = ZL_Mesh::BuildSphere(.1f, 5);
+			MeshBullet = ZL_Mesh::BuildPlane(ZLV(.1,.1), ZL_Material(MM_DIFFUSEMAP|MO_UNLIT|MO_MASKED|MO_CASTNOSHADOW).SetDiffuseTexture(ZL_Surface("Data/spark.png")));
+			break;
+		}
+		case LOAD_PARTICLES:
+		{
+			ParticleDamage = ZL_ParticleEmitter(.5f, 500, OP_TRANSPARENT);
+			ParticleDamage.SetTexture(ZL_Surface("Data/particle.png"), 1, 1);
+			ParticleDamage.SetLifetimeSize(.5f, .05f);
+			ParticleDamage.SetSpawnVelocityRanges(ZLV3(-.6,-.6,.1), ZLV3(.6,.6,.6));
+			ParticleDamage.SetSpawnColorRange(ZLRGB(.1,.1,.5), ZLRGB(.5,.5,.9));
+			ParticleDamage.SetLifetimeAlpha(.3f, 0);
+
+			ParticleDestroy = ZL_ParticleEmitter(1.5f, 500, OP_TRANSPARENT);
+			ParticleDestroy.SetTexture(ZL_Surface("Data/particle.png"), 1, 1);
+			ParticleDestroy.SetLifetimeSize(.5f, .05f);
+			ParticleDestroy.SetSpawnVelocityRanges(ZLV3(-.2,-.2,1), ZLV3(.2,.2,2));
+			ParticleDestroy.SetLifetimeAlpha(.3f, 0);
+
+			#ifdef ZILLALOG
+			MeshDbgCollision = ZL_Mesh::BuildPlane(ZLV(.3,.3));
+			MeshDbgSphere = ZL_Mesh::FromPLY("work/sphere.ply");
+			#endif
+			break;
+		}
+		case LOAD_SOUNDS:
+		{
+			#ifdef SHOOTZILLA_THREADS
+			AssetLoad.synth.join();
+			#else
+			while (AssetLoad.synthstep != SYNTH_COUNT) SynthesizeSound(AssetLoad.synthstep++);
+			#endif
+			imcMusic.Play();
+			break;
+		}
+		case LOAD_WARMUP:
+		{
+			if (WarmUp.enabled) WarmUpDraw();
+			if (Perf.log) printf("All assets loaded %.1f ms after start\n", TimeMs() - AssetLoad.start);
+			break;
+		}
+	}
+}
+
+// Between frames only one step is loaded and the sounds are not waited for, starting a game loads everything left at once
+static void LoadFrame()
+{
+	if (AssetsLoaded()) return;
+	#ifdef SHOOTZILLA_THREADS
+	if (AssetLoad.step == LOAD_SOUNDS && !AssetLoad.synthesized) return;
+	#else
+	if (AssetLoad.step == LOAD_SOUNDS && AssetLoad.synthstep != SYNTH_COUNT) { SynthesizeSound(AssetLoad.synthstep++); return; }
+	#endif
+	LoadStep();
+}
+
+static void LoadRemaining()
+{
+	while (!AssetsLoaded()) LoadStep();
+}
+
+static int CalcAttackCount(float dt, float& timer, float delay, bool attacking)
+{
+	int n = 0;
+	for (float dtx = dt, dtstep; (dtstep = ZL_Math::Min(dtx, delay)) > 0; dtx -= dtstep)
+	{
+		timer += dtstep;
+		if (!attacking) continue;
+		if (timer > 0) timer = 0;
+		if (timer < 0) continue;
+		timer -= delay;
+		n++;
+	}
+	return n;
+}
+
+// Per type enemy behavior as compile time policies, each enemy type lives in its own array and gets its own update loop
+template <class E> struct EnemyBehavior;
+
+template <> struct EnemyBehavior<EnemySpider>
+{
+	static void Plan(GameState& g, EnemySpider& e)
+	{
+		e.movetarget = AStarMoveTarget(g, e.mtx.GetTranslateXY(), g.player.mtx.GetTranslateXY());
+	}
+	static ZL_Vector3 Steer(EnemySpider& e)
+	{
+		e.move = (e.movetarget - e.mtx.GetTranslateXY()).Norm();
+		e.vel.z = 0;
+		return ZL_Vector3(e.move, 0);
+	}
+	static ZL_Quat Rotation(float movespeed, float yaw, float pitch) { return ZL_Quat::FromRotateZ(yaw + ssin(ZLTICKS*movespeed*.01f)*.1f) * ZL_Quat::FromRotateX(.5f); }
+	static const ZL_Mesh& Mesh(bool shadow) { return (shadow ? MeshSpider : MeshSpiderNoShadow); }
+};
+
+struct FlyingEnemyBehavior
+{
+	template <class E> static void Plan(GameState& g, E& e)
+	{
+		ZL_Vector3 epos = e.mtx.GetTranslate();
+		ZL_Vector eposxy = epos.ToXY();
+		ForEachEnemy(g, [&](const Enemy& e2)
+		{
+			ZL_Vector3 d = epos - e2.mtx.GetTranslate();
+			float distSq = d.GetLengthSq();
+			if (distSq < 0.01 || distSq > ZL_Math::Square(e.radius + e2.radius)) return;
+			float back = (e.radius + e2.radius) - ssqrt(distSq);
+			e.mtx.TranslateBy(d.VecNorm() * back);
+		});
+		float targetheight = VIEW_HEIGHT;
+		if (epos.z < 2.0f && g.player.mtx.GetTranslateXY().GetDistance(eposxy) > 5) targetheight = 2.0f;
+		e.move = ZL_Vector3(g.player.mtx.GetTranslate() + ZLV3(0, 0, targetheight) - epos).Norm();
+	}
+	template <class E> static ZL_Vector3 Steer(E& e) { return e.move; }
+};
+
+template <> struct EnemyBehavior<EnemyBat> : FlyingEnemyBehavior
+{
+	static ZL_Quat Rotation(float movespeed, float yaw, float pitch) { return ZL_Quat::FromRotateZ(yaw) * ZL_Quat::FromRotateX(pitch + ssin(ZLTICKS*movespeed*.01f)*.5f); }
+	static const ZL_Mesh& Mesh(bool shadow) { return (shadow ? MeshBat : MeshBatNoShadow); }
+};
+
+template <> struct EnemyBehavior<EnemyGhost> : FlyingEnemyBehavior
+{
+	static ZL_Quat Rotation(float movespeed, float yaw, float pitch) { return ZL_Quat::FromRotateZ(yaw) * ZL_Quat::FromRotateX(pitch); }
+	static const ZL_Mesh& Mesh(bool shadow) { return (shadow ? MeshGhost : MeshGhostNoShadow); }
+};
+
+enum { BULLET_MISS, BULLET_KILLED, BULLET_SPENT };
+
+template <class E> static bool DamageEnemy(GameState& g, std::vector<E>& list, size_t i, const ZL_Vector3& shotdir)
+{
+	E& e = list[i];
+	ZL_Vector3 epos = e.mtx.GetTranslate();
+	float erad = e.radius * .5f;
+
+	if ((e.health -= 1) <= 0)
+	{
+		EmitEvent(g, SimEvent::KILL, epos, erad);
+		list.erase(list.begin() + i);
+		g.kills++;
+		return true;
+	}
+	EmitEvent(g, SimEvent::HIT, epos, erad);
+	ZL_Vector3 pushback = shotdir * 0.5f;
+	if (pushback.z < 0) pushback.z = 0;
+	e.vel += pushback;
+	return false;
+}
+
+template <class E> static int BulletHit(GameState& g, std::vector<E>& list, const Bullet& b)
+{
+	for (size_t i = 0; i != list.size(); i++)
+	{
+		float distSq = list[i].mtx.GetTranslate().GetDistanceSq(b.mtx.GetTranslate());
+		if (distSq > ZL_Math::Square(list[i].radius + b.radius)) continue;
+		return (DamageEnemy(g, list, i, b.vel.VecNorm()) ? BULLET_KILLED : BULLET_SPENT);
+	}
+	return BULLET_MISS;
+}
+
+static void HitscanShot(GameState& g, const ZL_Vector3& from, const ZL_Vector3& dir)
+{
+	RayHit hit;
+	if (!RayCast(g, from, dir, 100, hit, true, Bullet().radius)) return;
+	switch (hit.what->type)
+	{
+		case Thing::ENEMY_SPIDER: DamageEnemy(g, g.spiders, (EnemySpider*)hit.what - &g.spiders[0], dir); break;
+		case Thing::ENEMY_BAT:    DamageEnemy(g, g.bats,    (EnemyBat*)hit.what    - &g.bats[0],    dir); break;
+		case Thing::ENEMY_GHOST:  DamageEnemy(g, g.ghosts,  (EnemyGhost*)hit.what  - &g.ghosts[0],  dir); break;
+		default:
+			EmitEvent(g, SimEvent::WALL_HIT, hit.pos - dir * .05f);
+			break;
+	}
+}
+
+static bool IsNearPlayer(GameState& g, const Enemy& e)
+{
+	return (e.mtx.GetTranslateXY().GetDistanceSq(g.player.mtx.GetTranslateXY()) < ZL_Math::Square(AILod.distance));
+}
+
+template <class E> static bool PlanFarEnemy(GameState& g, E& e, unsigned int interval, double& planms)
+{
+	if (!e.aiframe || g.aiframes - e.aiframe < interval || IsNearPlayer(g, e)) return true;
+	if (!g.headless && planms >= AILod.budgetms) return false; //headless games stay deterministic
+	double start = TimeMs();
+	e.aiframe = g.aiframes;
+	EnemyBehavior<E>::Plan(g, e);
+	planms += TimeMs() - start;
+	return true;
+}
+
+// Far enemies due for a re-plan are visited round-robin from where the previous frame's budget ran out so none of them starves
+static void PlanFarEnemies(GameState& g, unsigned int interval)
+{
+	size_t spiders = g.spiders.size(), bats = g.bats.size(), n = spiders + bats + g.ghosts.size();
+	if (!n) return;
+	double planms = 0;
+	size_t i = g.aicursor % n;
+	for (size_t visited = 0; visited != n; visited++, i = (i + 1 == n ? 0 : i + 1))
+	{
+		bool inbudget = (i < spiders ? PlanFarEnemy(g, g.spiders[i], interval, planms) :
+			(i < spiders + bats ? PlanFarEnemy(g, g.bats[i - spiders], interval, planms) : PlanFarEnemy(g, g.ghosts[i - spiders - bats], interval, planms)));
+		if (!inbudget) break;
+	}
+	g.aicursor = i;
+}
+
+template <class E> static bool UpdateEnemies(GameState& g, std::vector<E>& list, float dt, unsigned int interval)
+{
+	for (E& e : list)
+	{
+		bool near = IsNearPlayer(g, e);
+		if (near || !e.aiframe)
+		{
+			// the first plan of a far enemy is backdated by its id to spread the work of a horde spawned at once over multiple frames
+			e.aiframe = (e.aiframe || near ? g.aiframes : g.aiframes - (e.id % interval));
+			EnemyBehavior<E>::Plan(g, e);
+		}
+		e.vel = ZL_Vector3::Lerp(e.vel, EnemyBehavior<E>::Steer(e)*e.movespeed, dt);
+		DoMove(g, e, dt);
+
+		ZL_Vector3 diff = e.mtx.GetTranslate() - g.player.mtx.GetTranslate();
+		float distSq = diff.GetLengthSq();
+		if (distSq < ZL_Math::Square(e.radius + g.player.radius + .1f) && CalcAttackCount(dt, e.attacktimer, e.attackspeed, true))
+		{
+			g.player.lasthit = g.ticks;
+			if (!Stress.invulnerable) g.player.health -= e.attackdamage;
+			EmitEvent(g, SimEvent::PLAYER_DAMAGED, g.player.mtx.GetTranslate(), g.player.radius * .5f);
+			if (g.player.health <= 0)
 			{
-				sndHit.Play();
-				for (int pn = 0; pn != 50; pn++)
-				{
-					ParticleDamage.Spawn(ZLV3(RAND_RANGE(epos.x-erad, epos.x+erad), RAND_RANGE(epos.y-erad, epos.y+erad), RAND_RANGE(epos.z-erad, epos.z+erad)));
-				}
-				ZL_Vector3 pushback = b.vel.VecNorm() * 0.5f;
-				if (pushback.z < 0) pushback.z = 0;
-				e.vel += pushback;
-				bullets.erase(bullets.begin()+(i--));
+				EmitEvent(g, SimEvent::PLAYER_KILLED, g.player.mtx.GetTranslate(), g.player.radius * .5f);
+				g.bullets.clear();
+				g.gameover = g.ticks;
+				return true;
 			}
-			break;
+			ZL_Vector3 pushback = diff.ToXY().Norm();
+			g.player.vel -= pushback * 1.0f;
+			e.vel += pushback * 1.0f;
+		}
+	}
+	return false;
+}
+
+static void ApplyMouseLook()
+{
+	ZL_Vector md = ZL_Input::MouseDelta();
+	if (md.x || md.y)
+	{
+		ZL_Vector3 curdir = ViewDir.VecNorm();
+		ZL_Vector3 forward = ZL_Vector3(curdir.ToXY().Norm(), 0);
+		ZL_Vector3 right = ZL_Vector3(forward.ToXY().RPerp());
+		float pitch = curdir.GetRelAbsAngle(forward) * (curdir.z < 0 ? -1 : 1);
+		float newpitch = ZL_Math::Clamp(pitch + md.y * SPEED_PITCH, -PIHALF*0.99f, PIHALF*0.99f);
+		ViewDir.Rotate(right, newpitch - pitch);
+		ViewDir.Rotate(ZL_Vector3::Up, -md.x * SPEED_YAW);
+		ViewDir.Norm();
+	}
+}
+
+// Input state of one frame, read on the main thread and handed to the simulation tick
+struct InputFrame
+{
+	ZL_Vector wasd;
+	ZL_Vector3 dir = ZLV3(0,1,0);
+	bool fire = false, jump = false;
+	float dt = 0;
+	ticks_t ticks = 0, elapsedticks = 0;
+};
+
+static InputFrame CaptureInput(bool controls)
+{
+	InputFrame in;
+	in.dt = ZL_Math::Min(ZLELAPSED, .333f);
+	in.ticks = ZLTICKS;
+	in.elapsedticks = ZLELAPSEDTICKS;
+	in.dir = ViewDir;
+	if (!controls) return in;
+	in.wasd = ZLV(((ZL_Input::Held(ZLK_D) || ZL_Input::Held(ZLK_RIGHT)) ? 1.0f : ((ZL_Input::Held(ZLK_A) || ZL_Input::Held(ZLK_LEFT)) ? -1.0f : 0)), 
+	              ((ZL_Input::Held(ZLK_W) || ZL_Input::Held(ZLK_UP   )) ? 1.0f : ((ZL_Input::Held(ZLK_S) || ZL_Input::Held(ZLK_DOWN)) ? -1.0f : 0)));
+	in.fire = (!!ZL_Input::Held(ZL_BUTTON_LEFT));
+	in.jump = (ZL_Input::Down(ZLK_SPACE) || ZL_Input::Down(ZL_BUTTON_RIGHT));
+	return in;
+}
+
+static float SimSinceSeconds(GameState& g, ticks_t t)
+{
+	return (int)(g.ticks - t) / 1000.0f;
+}
+
+static void UpdateWave(GameState& g)
+{
+	if (g.waveticks == 0) { g.waveticks = g.ticks-2000; }
+
+	float wavet = SimSinceSeconds(g, g.waveticks), wavetold = SimSinceSeconds(g, g.waveticks+g.elapsedticks);
+	if (wavet >= 0 && wavetold < 2)
+	{
+		FadeWalls(g, 1-ZL_Math::Clamp01(wavet*.5f));
+	}
+	if (wavetold < 2.0f && wavet >= 2.0f)
+	{
+		double switchstart = TimeMs();
+		g.wave++;
+		StartWave(g);
+		if (Perf.log && !g.headless) printf("Perf wave %d: layout switched in %.3f ms\n", g.wave, TimeMs() - switchstart);
+	}
+	if (wavet >= 2 && wavetold < 4)
+	{
+		FadeWalls(g, ZL_Math::Clamp01((wavet-2)*.5f));
+	}
+	float spawnspeed = 1.0f + g.wave / 30.0f;
+	if (wavet >= 5 && g.wavespawns && (int)(wavetold*spawnspeed) != (int)(wavet*spawnspeed))
+	{
+		g.wavespawns--;
+		SpawnEnemy(g);
+	}
+	if (wavet >= 5 && !g.wavespawns && !EnemyCount(g))
+	{
+		g.waveticks = g.ticks;
+	}
+}
+
+// Jumping and walking only depend on the input and the map, a networked client predicts its own player with it
+static void MovePlayer(GameState& g, const InputFrame& in)
+{
+	float dt = in.dt;
+	if (in.jump && g.player.jumps)
+	{
+		g.player.jumps--;
+		g.player.vel.z = JUMP_STRENGTH;
+		EmitEvent(g, SimEvent::JUMP);
+	}
+	ZL_Vector forward2d = in.dir.ToXY().Norm();
+	ZL_Vector right2d = forward2d.VecRPerp();
+	ZL_Vector move = forward2d * (in.wasd.y * SPEED_FORWARD) + right2d * (in.wasd.x * SPEED_STRAFE);
+	float newvelz = g.player.vel.z + dt*SPEED_GRAV;
+	g.player.vel = ZL_Vector3::Lerp(g.player.vel, move, dt*(g.player.vel.z ? SPEED_AIRACCEL : SPEED_ACCEL));
+	g.player.vel.z = newvelz;
+
+	DoMove(g, g.player, dt, CAN_STEP_HEIGHT);
+	if (g.player.vel.z == 0) g.player.jumps = 2;
+}
+
+static void UpdatePlayer(GameState& g, const InputFrame& in)
+{
+	g.player.dir = in.dir;
+	for (int i = CalcAttackCount(in.dt, g.player.weapontimer, Stress.weapondelay, in.fire); i--;)
+	{
+		EmitEvent(g, SimEvent::SHOT);
+		if (Hitscan)
+		{
+			HitscanShot(g, g.player.mtx.GetTranslate() + ZLV3(0, 0, VIEW_HEIGHT), g.player.dir);
+			continue;
+		}
+		if (g.bullets.size() == g.bullets.capacity()) continue; //pool is full
+		Bullet b;
+		b.id = ++g.thingids;
+		b.mtx = ZL_Matrix::MakeTranslate(g.player.mtx.GetTranslate() + ZLV3(0, 0, VIEW_HEIGHT*.8f));
+		b.vel = g.player.dir * BULLET_SPEED;
+		b.vel.z += 0.1f;
+		g.bullets.push_back(b);
+	}
+	MovePlayer(g, in);
+}
+
+static void UpdateWorld(GameState& g, float dt)
+{
+	for (size_t i = 0; i != g.bullets.size(); i++)
+	{
+		Bullet& b = g.bullets[i];
+		if (DoMove(g, b, dt))
+		{
+			g.bullets.erase(g.bullets.begin()+(i--));
+			continue;
+		}
+
+		int hit = BulletHit(g, g.spiders, b);
+		if (!hit) hit = BulletHit(g, g.bats, b);
+		if (!hit) hit = BulletHit(g, g.ghosts, b);
+		if (hit == BULLET_SPENT) g.bullets.erase(g.bullets.begin()+(i--));
+	}
+
+	g.aiframes++;
+	unsigned int interval = AILod.interval * GovernorLevels[Governor.level].aiintervalscale;
+	PlanFarEnemies(g, interval);
+	if (!UpdateEnemies(g, g.spiders, dt, interval) && !UpdateEnemies(g, g.bats, dt, interval)) UpdateEnemies(g, g.ghosts, dt, interval); //stop once the player died
+	if (!g.gameover) UpdateWave(g);
+}
+
+static void Update(GameState& g, const InputFrame& in)
+{
+	g.ticks = in.ticks;
+	g.elapsedticks = in.elapsedticks;
+	if (g.player.health <= 0) return;
+	UpdatePlayer(g, in);
+	UpdateWorld(g, in.dt);
+}
+
+// Scripted players for unattended runs, they produce the same inputs as keyboard and mouse from the game state
+const float BOT_DODGE_DISTANCE = 1.5f, BOT_ENGAGE_DISTANCE = 6.0f, SOAK_REPORT_SECONDS = 10.0f;
+static struct sBot
+{
+	bool active = false;
+	float soakseconds = 0;
+} Bot;
+
+static InputFrame BotInput(GameState& g, InputFrame in)
+{
+	Player& p = g.player;
+	ZL_Vector3 ppos = p.mtx.GetTranslate(), eye = ppos + ZLV3(0, 0, VIEW_HEIGHT);
+	const Enemy* target = NULL;
+	float targetdistSq = 0;
+	ForEachEnemy(g, [&](const Enemy& e)
+	{
+		float distSq = e.mtx.GetTranslate().GetDistanceSq(eye);
+		if (!target || distSq < targetdistSq) { target = &e; targetdistSq = distSq; }
+	});
+
+	// walk to the middle between waves, otherwise aim at the nearest enemy, circle it at a distance and dodge when it comes close
+	ZL_Vector move;
+	bool visible = false;
+	in.jump = false;
+	if (!target) move = AStarMoveTarget(g, ppos.ToXY(), ZLV(MAPW*.5f, MAPH*.5f)) - ppos.ToXY();
+	else
+	{
+		ZL_Vector3 tpos = target->mtx.GetTranslate();
+		ZL_Vector away = ppos.ToXY() - tpos.ToXY();
+		float dist = ssqrt(targetdistSq), side = (((g.ticks / 1500) & 1) ? 1.0f : -1.0f);
+		visible = HasLineOfSight(g, eye, tpos);
+		in.dir = (tpos - eye).VecNorm();
+		if (dist < BOT_DODGE_DISTANCE) move = away.VecNorm() + away.VecPerp().Norm() * side;
+		else if (!visible || dist > BOT_ENGAGE_DISTANCE) move = AStarMoveTarget(g, ppos.ToXY(), tpos.ToXY()) - ppos.ToXY();
+		else move = away.VecPerp() * side;
+		in.jump = (dist < BOT_DODGE_DISTANCE * .5f && p.vel.z == 0);
+	}
+	in.fire = visible;
+	in.wasd = ZLV(0, 0);
+	if (move.GetLengthSq() < .0001f) return in;
+
+	move.Norm();
+	if (!target) in.dir = ZL_Vector3(move, 0);
+	ZL_Vector forward = in.dir.ToXY().Norm(), right = forward.VecRPerp();
+	float f = (move | forward), r = (move | right);
+	in.wasd = ZLV((r > .38f ? 1.0f : (r < -.38f ? -1.0f : 0)), (f > .38f ? 1.0f : (f < -.38f ? -1.0f : 0)));
+	if (p.vel.z == 0 && p.vel.ToXY().GetLengthSq() < .01f && g.RandChance(30)) in.jump = true; //stuck on something
+	return in;
+}
+
+static float ResidentMB()
+{
+	#ifdef __linux__
+	long pages = 0, resident = 0;
+	FILE* f = fopen("/proc/self/statm", "r");
+	if (!f) return 0;
+	int n = fscanf(f, "%ld %ld", &pages, &resident);
+	fclose(f);
+	return (n == 2 ? resident * (float)sysconf(_SC_PAGESIZE) / (1024 * 1024) : 0);
+	#else
+	return 0;
+	#endif
+}
+
+// Results of the bot games and frame (or headless tick) times and memory over the run, logged every 10 seconds
+static struct sSoak
+{
+	double start = 0, reporttime = 0;
+	ticks_t gamestart = 0;
+	int games = 0, bestwave = 0;
+	long long wavesum = 0;
+	FrameTimes times = FrameTimes((size_t)(SOAK_REPORT_SECONDS * 60 * 2));
+} Soak;
+
+static void SoakGameEnded(const GameState& g)
+{
+	Soak.games++;
+	Soak.wavesum += g.wave;
+	Soak.bestwave = ZL_Math::Max(Soak.bestwave, g.wave);
+	printf("Bot game %d: wave %d, %d kills, %.0f seconds\n", Soak.games, g.wave, g.kills, (g.gameover - Soak.gamestart) / 1000.0f);
+}
+
+static void SoakReport(int wave, const char* what, bool force = false)
+{
+	double now = TimeMs();
+	if (!force && now - Soak.reporttime < SOAK_REPORT_SECONDS * 1000) return;
+	Soak.reporttime = now;
+	printf("Soak %.0f s: %d games (best wave %d, average %.1f), current wave %d, %.1f MB resident\n",
+		(now - Soak.start) / 1000, Soak.games, Soak.bestwave, (Soak.games ? Soak.wavesum / (float)Soak.games : 0), wave, ResidentMB());
+	Soak.times.Report(what);
+	fflush(stdout);
+}
+
+static size_t RenderThingCount(const RenderState& rs)
+{
+	return rs.bullets.size() + rs.spiders.size() + rs.bats.size() + rs.ghosts.size();
+}
+
+template <class E> static void RenderCaptureEnemies(std::vector<RenderThing>& out, const std::vector<E>& list)
+{
+	out.clear();
+	for (const E& e : list) out.push_back({ e.radius, e.movespeed, e.mtx.GetTranslate() });
+}
+
+static void RenderCapture(GameState& g, RenderState& rs)
+{
+	rs.title = IsTitle;
+	rs.wave = g.wave;
+	rs.enemiesleft = g.wavespawns + EnemyCount(g);
+	rs.kills = g.kills;
+	rs.waveticks = g.waveticks;
+	rs.gameover = g.gameover;
+	rs.lasthit = g.player.lasthit;
+	rs.health = g.player.health;
+	rs.maxhealth = g.player.maxhealth;
+	rs.playerpos = g.player.mtx.GetTranslate();
+	rs.bullets.clear();
+	for (const Bullet& b : g.bullets) rs.bullets.push_back({ b.radius, 0, b.mtx.GetTranslate() });
+	RenderCaptureEnemies(rs.spiders, g.spiders);
+	RenderCaptureEnemies(rs.bats, g.bats);
+	RenderCaptureEnemies(rs.ghosts, g.ghosts);
+	if (rs.mapversion != g.mapversion)
+	{
+		memcpy(rs.map, g.map, sizeof(g.map));
+		memcpy(rs.heights, g.heights, sizeof(g.heights));
+		rs.mapversion = g.mapversion;
+	}
+}
+
+// Networked play within one process: the client predicts its own player from buffered inputs and reconciles it with the
+// authoritative snapshots of the server, everything else is interpolated. The link in between delays and drops packets.
+enum { NET_HISTORY = 64, NET_MAX_RESEND = 32 };
+const float NET_INTERP_DELAY_MS = 100.0f, NET_CORRECTION_EPSILON = 0.02f;
+
+struct NetLink
+{
+	struct Packet { double deliver; std::vector<unsigned char> data; };
+	std::vector<Packet> queue;
+	int sent = 0, lost = 0;
+	void Send(const std::vector<unsigned char>& data, float delayms, bool drop)
+	{
+		sent++;
+		if (drop) { lost++; return; }
+		queue.push_back({ TimeMs() + delayms, data });
+	}
+	bool Receive(std::vector<unsigned char>& out)
+	{
+		if (queue.empty() || queue[0].deliver > TimeMs()) return false;
+		out.swap(queue[0].data);
+		queue.erase(queue.begin());
+		return true;
+	}
+};
+
+// An input with the predicted player state after applying it
+struct NetInput
+{
+	unsigned int seq;
+	InputFrame in;
+	ZL_Vector3 pos, vel;
+	int jumps;
+};
+
+static struct sNet
+{
+	bool active = false;
+	float rttms = 100, loss = 0;
+	ZL_SeededRand rand = ZL_SeededRand(1);
+	NetLink up, down;
+	std::vector<unsigned char> packet, snapdata;
+
+	// client side, predicts in its own game state which only holds the player and a copy of the map
+	GameState* client = NULL;
+	unsigned int seq = 0, lastsnap = 0;
+	std::vector<NetInput> pending;
+	Snapshot received[NET_HISTORY];
+	double receivedtime[NET_HISTORY], clockoffset = 0;
+
+	// server side, inputs received for the next tick and the snapshots sent as delta baselines
+	unsigned int serverseq = 0, appliedseq = 0, servertick = 0, serverack = 0;
+	std::vector<NetInput> serverinputs;
+	Snapshot sent[NET_HISTORY];
+
+	int snapshots = 0, corrections = 0, replayed = 0, snapbytes = 0, skippedinputs = 0;
+	float correctionsum = 0, correctionmax = 0;
+	double reporttime = 0;
+} Net;
+
+static const Snapshot NetEmptySnapshot;
+
+static ZL_Vector3 SnapPos(const SnapThing& st) { return ZLV3(st.f[SNAP_X] / 256.0f, st.f[SNAP_Y] / 256.0f, st.f[SNAP_Z] / 256.0f - 4); }
+static ZL_Vector3 SnapVel(const SnapThing& st) { return ZLV3(st.f[SNAP_VX] / 64.0f, st.f[SNAP_VY] / 64.0f, st.f[SNAP_VZ] / 64.0f); }
+
+static void NetWriteInput(BitWriter& bw, const InputFrame& in)
+{
+	bw.Write((unsigned int)(in.wasd.x + 1), 2);
+	bw.Write((unsigned int)(in.wasd.y + 1), 2);
+	bw.Write(in.fire, 1);
+	bw.Write(in.jump, 1);
+	bw.Write((unsigned int)ZL_Math::Clamp((int)(in.dt * 8192 + .5f), 0, 4095), 12);
+	bw.Write((unsigned int)SnapQuantize(in.dir.x, 2047, 12, true), 12);
+	bw.Write((unsigned int)SnapQuantize(in.dir.y, 2047, 12, true), 12);
+	bw.Write((unsigned int)SnapQuantize(in.dir.z, 2047, 12, true), 12);
+}
+
+static void NetReadInput(BitReader& br, InputFrame& in)
+{
+	in.wasd.x = (float)((int)br.Read(2) - 1);
+	in.wasd.y = (float)((int)br.Read(2) - 1);
+	in.fire = !!br.Read(1);
+	in.jump = !!br.Read(1);
+	in.dt = br.Read(12) / 8192.0f;
+	for (float* d : { &in.dir.x, &in.dir.y, &in.dir.z })
+	{
+		int v = (int)br.Read(12);
+		*d = (v >= 2048 ? v - 4096 : v) / 2047.0f;
+	}
+}
+
+static void NetSendDelay(NetLink& link, const std::vector<unsigned char>& data)
+{
+	link.Send(data, Net.rttms * .5f, Net.rand.Range(0.f, 1.f) < Net.loss);
+}
+
+static void NetReset()
+{
+	if (!Net.client)
+	{
+		Net.client = new GameState();
+		Net.client->headless = true;
+		Net.client->asyncprep = false;
+	}
+	Net.client->player = Game.player;
+	Net.client->mapversion = Game.mapversion - 1;
+	Net.seq = Net.lastsnap = Net.serverseq = Net.appliedseq = Net.serverack = 0;
+	Net.pending.clear();
+	Net.serverinputs.clear();
+	Net.up.queue.clear();
+	Net.down.queue.clear();
+	for (Snapshot& snap : Net.received) snap.tick = 0;
+	for (Snapshot& snap : Net.sent) snap.tick = 0;
+	Net.reporttime = TimeMs();
+}
+
+// Runs on the simulation thread instead of Update, the player moves once for every input that arrived
+static void NetServerTick(GameState& g, const InputFrame& frame)
+{
+	g.ticks = frame.ticks;
+	g.elapsedticks = frame.elapsedticks;
+	for (const NetInput& ni : Net.serverinputs)
+	{
+		if (g.player.health > 0) UpdatePlayer(g, ni.in);
+		Net.appliedseq = ni.seq;
+	}
+	Net.serverinputs.clear();
+	if (g.player.health > 0) UpdateWorld(g, frame.dt);
+}
+
+// Runs on the main thread while the simulation is idle
+static void NetServerFrame()
+{
+	GameState& g = Game;
+	while (Net.up.Receive(Net.packet))
+	{
+		BitReader br(&Net.packet[0], Net.packet.size());
+		unsigned int ack = br.Read(32), first = br.Read(32), count = br.Read(6);
+		if ((int)(ack - Net.serverack) > 0) Net.serverack = ack;
+		for (unsigned int i = 0; i != count; i++)
+		{
+			NetInput ni;
+			NetReadInput(br, ni.in);
+			ni.seq = first + i;
+			if (br.overflow || (int)(ni.seq - Net.serverseq) <= 0) continue; //already received in an earlier packet
+			Net.skippedinputs += ni.seq - Net.serverseq - 1; //inputs lost for longer than the client resends them are skipped
+			Net.serverinputs.push_back(ni);
+			Net.serverseq = ni.seq;
+		}
+	}
+
+	// the snapshot is delta encoded against the newest one the client has acknowledged
+	Snapshot& snap = Net.sent[++Net.servertick % NET_HISTORY];
+	SnapshotCapture(g, snap, Net.servertick);
+	const Snapshot& base = (Net.serverack && Net.sent[Net.serverack % NET_HISTORY].tick == Net.serverack ? Net.sent[Net.serverack % NET_HISTORY] : NetEmptySnapshot);
+	SnapshotEncode(base, snap, Net.snapdata);
+	{
+		BitWriter bw(Net.packet);
+		bw.Write((unsigned int)g.ticks, 32);
+		bw.Write(Net.appliedseq, 32);
+	}
+	Net.packet.insert(Net.packet.end(), Net.snapdata.begin(), Net.snapdata.end());
+	NetSendDelay(Net.down, Net.packet);
+	Net.snapbytes += (int)Net.snapdata.size();
+
+	// the level is not part of the snapshots, a real server would send the wave seed
+	if (Net.client->mapversion != g.mapversion)
+	{
+		memcpy(Net.client->map, g.map, sizeof(g.map));
+		memcpy(Net.client->heights, g.heights, sizeof(g.heights));
+		Net.client->mapversion = g.mapversion;
+	}
+}
+
+static void NetReconcile(const Snapshot& snap, unsigned int inputack)
+{
+	Player& p = Net.client->player;
+	p.health = snap.player.f[SNAP_HEALTH] / 8.0f;
+	size_t acked = 0;
+	while (acked != Net.pending.size() && Net.pending[acked].seq <= inputack) acked++;
+	if (!acked || Net.pending[acked - 1].seq != inputack) return;
+	Net.snapshots++;
+
+	// the prediction for the acknowledged input is compared against the server, on a mismatch the later inputs are replayed
+	const NetInput& ni = Net.pending[acked - 1];
+	ZL_Vector3 serverpos = SnapPos(snap.player);
+	float error = serverpos.GetDistance(ni.pos);
+	if (error > NET_CORRECTION_EPSILON)
+	{
+		Net.corrections++;
+		Net.correctionsum += error;
+		Net.correctionmax = ZL_Math::Max(Net.correctionmax, error);
+		p.mtx.SetTranslate(serverpos);
+		p.vel = SnapVel(snap.player);
+		p.jumps = ni.jumps;
+		for (size_t i = acked; i != Net.pending.size(); i++)
+		{
+			NetInput& replay = Net.pending[i];
+			if (p.health > 0) MovePlayer(*Net.client, replay.in);
+			replay.pos = p.mtx.GetTranslate();
+			replay.vel = p.vel;
+			replay.jumps = p.jumps;
+			Net.replayed++;
+		}
+	}
+	Net.pending.erase(Net.pending.begin(), Net.pending.begin() + acked);
+}
+
+static void NetClientReceive()
+{
+	if (Net.packet.size() < 16) return;
+	BitReader hdr(&Net.packet[0], 8), snaphdr(&Net.packet[8], 8);
+	unsigned int servertime = hdr.Read(32), inputack = hdr.Read(32);
+	unsigned int tick = snaphdr.Read(32), basetick = snaphdr.Read(32);
+	if ((int)(tick - Net.lastsnap) <= 0) return; //older than what we have
+	const Snapshot& base = (basetick ? Net.received[basetick % NET_HISTORY] : NetEmptySnapshot);
+	if (base.tick != basetick) return; //baseline no longer known
+	Snapshot& snap = Net.received[tick % NET_HISTORY];
+	if (!SnapshotDecode(base, &Net.packet[8], Net.packet.size() - 8, snap)) { snap.tick = 0; return; }
+	Net.receivedtime[tick % NET_HISTORY] = servertime;
+	Net.clockoffset = servertime - TimeMs();
+	Net.lastsnap = tick;
+	NetReconcile(snap, inputack);
+}
+
+// Runs on the main thread every frame of a game, receives snapshots, predicts the local player and sends the inputs
+static void NetClientFrame(const InputFrame& in)
+{
+	GameState& c = *Net.client;
+	c.arena.Reset();
+	while (Net.down.Receive(Net.packet)) NetClientReceive();
+
+	// the input is predicted exactly as the server will see it after quantization
+	NetInput ni;
+	{
+		BitWriter bw(Net.packet);
+		NetWriteInput(bw, in);
+	}
+	BitReader br(&Net.packet[0], Net.packet.size());
+	NetReadInput(br, ni.in);
+	ni.seq = ++Net.seq;
+	if (c.player.health > 0) MovePlayer(c, ni.in);
+	ni.pos = c.player.mtx.GetTranslate();
+	ni.vel = c.player.vel;
+	ni.jumps = c.player.jumps;
+	if (Net.pending.size() == NET_HISTORY) Net.pending.erase(Net.pending.begin());
+	Net.pending.push_back(ni);
+
+	// every packet repeats the unacknowledged inputs so a lost packet doesn't lose input
+	size_t first = (Net.pending.size() > NET_MAX_RESEND ? Net.pending.size() - NET_MAX_RESEND : 0);
+	{
+		BitWriter bw(Net.packet);
+		bw.Write(Net.lastsnap, 32);
+		bw.Write(Net.pending[first].seq, 32);
+		bw.Write((unsigned int)(Net.pending.size() - first), 6);
+		for (size_t i = first; i != Net.pending.size(); i++) NetWriteInput(bw, Net.pending[i].in);
+	}
+	NetSendDelay(Net.up, Net.packet);
+}
+
+// The drawn state gets the predicted player and the other things interpolated between the two snapshots around the render time
+static void NetClientView(RenderState& rs)
+{
+	rs.playerpos = Net.client->player.mtx.GetTranslate();
+	double rendertime = TimeMs() + Net.clockoffset - NET_INTERP_DELAY_MS;
+	const Snapshot *a = NULL, *b = NULL;
+	double atime = 0, btime = 0;
+	for (int i = 0; i != NET_HISTORY; i++)
+	{
+		const Snapshot& snap = Net.received[i];
+		if (!snap.tick || Net.lastsnap - snap.tick >= NET_HISTORY) continue;
+		double t = Net.receivedtime[i];
+		if (t <= rendertime && (!a || t > atime)) { a = &snap; atime = t; }
+		if (t > rendertime && (!b || t < btime)) { b = &snap; btime = t; }
+	}
+	if (!a) { a = b; atime = btime; }
+	if (!b) { b = a; btime = atime; }
+	if (!a) return;
+	float f = (btime > atime ? (float)((rendertime - atime) / (btime - atime)) : 1.0f);
+
+	std::vector<RenderThing>* lists[] = { &rs.bullets, &rs.spiders, &rs.bats, &rs.ghosts };
+	for (std::vector<RenderThing>* list : lists) list->clear();
+	for (size_t ia = 0, ib = 0; ia != a->things.size() || ib != b->things.size();)
+	{
+		const SnapThing* ta = (ia != a->things.size() ? &a->things[ia] : NULL);
+		const SnapThing* tb = (ib != b->things.size() ? &b->things[ib] : NULL);
+		const SnapThing* t;
+		ZL_Vector3 pos;
+		if (ta && tb && ta->id == tb->id) { t = tb; pos = ZL_Vector3::Lerp(SnapPos(*ta), SnapPos(*tb), f); ia++, ib++; }
+		else if (ta && (!tb || ta->id < tb->id)) { ia++; if (f >= .5f) continue; t = ta; pos = SnapPos(*ta); } //removed
+		else { ib++; if (f < .5f) continue; t = tb; pos = SnapPos(*tb); } //spawned
+		switch (t->type)
+		{
+			case Thing::BULLET:       rs.bullets.push_back({ .1f, 0, pos }); break;
+			case Thing::ENEMY_SPIDER: rs.spiders.push_back({ .25f, 2.0f, pos }); break;
+			case Thing::ENEMY_BAT:    rs.bats.push_back({ .25f, 2.0f, pos }); break;
+			case Thing::ENEMY_GHOST:  rs.ghosts.push_back({ .5f, 2.0f, pos }); break;
+		}
+	}
+}
+
+static void NetReportFrame()
+{
+	double now = TimeMs();
+	if (now - Net.reporttime < PERF_REPORT_SECONDS * 1000) return;
+	float seconds = (float)((now - Net.reporttime) / 1000);
+	printf("Net (%.0f ms round trip, %.0f%% loss): %d snapshots acknowledged input, %.1f corrections per second (%.1f%%), correction avg %.3f max %.3f tiles, %.1f inputs replayed per correction\n",
+		Net.rttms, Net.loss * 100, Net.snapshots, Net.corrections / seconds, (Net.snapshots ? Net.corrections * 100.0f / Net.snapshots : 0), (Net.corrections ? Net.correctionsum / Net.corrections : 0), Net.correctionmax, (Net.corrections ? Net.replayed / (float)Net.corrections : 0));
+	printf("    %.0f bytes per snapshot, %d of %d input packets and %d of %d snapshot packets lost, %d inputs skipped by the server\n",
+		(Net.down.sent ? Net.snapbytes / (float)Net.down.sent : 0), Net.up.lost, Net.up.sent, Net.down.lost, Net.down.sent, Net.skippedinputs);
+	fflush(stdout);
+	Net.reporttime = now;
+	Net.snapshots = Net.corrections = Net.replayed = Net.snapbytes = Net.skippedinputs = 0;
+	Net.correctionsum = Net.correctionmax = 0;
+	Net.up.sent = Net.up.lost = Net.down.sent = Net.down.lost = 0;
+}
+
+// Game flow driven by input, runs on the main thread while the simulation is idle
+static bool UpdateFlow()
+{
+	GameState& g = Game;
+	if (IsTitle)
+	{
+		if (ZL_Input::Down(ZLK_ESCAPE))
+		{
+			ZL_Application::Quit();
+		}
+		if (Bot.active || ZL_Input::Down(ZLK_SPACE) || ZL_Input::Down(ZL_BUTTON_LEFT) || ZL_Input::Down(ZL_BUTTON_RIGHT))
+		{
+			LoadRemaining();
+			Reset(g);
+			Soak.gamestart = ZLTICKS;
+			ViewDir = g.player.dir;
+			if (Net.active) NetReset();
+			IsTitle = false;
+			return true;
+		}
+		return false;
+	}
+
+	if (ZL_Input::Down(ZLK_ESCAPE)) { IsTitle = true; return true; }
+	#ifdef ZILLALOG
+	if (ZL_Input::Down(ZLK_F5)) g.waveticks = ZLTICKS;
+	#endif
+	if (g.gameover && ZLSINCESECONDS(g.gameover) > 1.0f)
+	{
+		if (Bot.active || ZL_Input::Down(ZLK_SPACE) || ZL_Input::Down(ZL_BUTTON_LEFT) || ZL_Input::Down(ZL_BUTTON_RIGHT))
+		{
+			if (Bot.active) SoakGameEnded(g);
+			IsTitle = true;
+			return true;
+		}
+	}
+	return false;
+}
+
+// The simulation of the next tick runs on its own thread while the main thread draws the previous one
+static struct sSimThread
+{
+	#ifdef SHOOTZILLA_THREADS
+	bool pipelined = true;
+	#else
+	bool pipelined = false;
+	#endif
+	float ms = 0;
+	InputFrame input;
+	#ifdef SHOOTZILLA_THREADS
+	std::thread thread;
+	std::mutex mutex;
+	std::condition_variable cond;
+	bool busy = false, quit = false;
+	~sSimThread()
+	{
+		if (!thread.joinable()) return;
+		{ std::lock_guard<std::mutex> lock(mutex); quit = true; }
+		cond.notify_all();
+		thread.join();
+	}
+	#endif
+} SimThread;
+
+static void SimTick()
+{
+	double start = TimeMs();
+	Game.arena.Reset();
+	Game.events = &RenderStates[simbuf].events;
+	Game.events->clear();
+	if (!IsTitle && Net.active) NetServerTick(Game, SimThread.input);
+	else if (!IsTitle) Update(Game, SimThread.input);
+	RenderCapture(Game, RenderStates[simbuf]);
+	SimThread.ms = (float)(TimeMs() - start);
+}
+
+#ifdef SHOOTZILLA_THREADS
+static void SimThreadMain()
+{
+	std::unique_lock<std::mutex> lock(SimThread.mutex);
+	for (;;)
+	{
+		SimThread.cond.wait(lock, []() { return SimThread.busy || SimThread.quit; });
+		if (SimThread.quit) return;
+		lock.unlock();
+		SimTick();
+		lock.lock();
+		SimThread.busy = false;
+		SimThread.cond.notify_all();
+	}
+}
+#endif
+
+static void SimStart(const InputFrame& in)
+{
+	SimThread.input = in;
+	#ifdef SHOOTZILLA_THREADS
+	if (SimThread.pipelined)
+	{
+		if (!SimThread.thread.joinable()) SimThread.thread = std::thread(SimThreadMain);
+		std::lock_guard<std::mutex> lock(SimThread.mutex);
+		SimThread.busy = true;
+		SimThread.cond.notify_all();
+		return;
+	}
+	#endif
+	SimTick();
+}
+
+static void SimFinish()
+{
+	#ifdef SHOOTZILLA_THREADS
+	std::unique_lock<std::mutex> lock(SimThread.mutex);
+	SimThread.cond.wait(lock, []() { return !SimThread.busy; });
+	#endif
+}
+
+static void DrawTextBordered(const ZL_Vector& p, const char* txt, scalar scale = 1, const ZL_Color& colfill = ZLWHITE, const ZL_Color& colborder = ZLBLACK, int border = 2, ZL_Origin::Type origin = ZL_Origin::Center)
+{
+	for (int i = 0; i < 9; i++) if (i != 4) fntBig.Draw(p.x+(border*((i%3)-1)), p.y+8+(border*((i/3)-1)), txt, scale, scale, colborder, origin);
+	fntBig.Draw(p.x  , p.y+8  , txt, scale, scale, colfill, origin);
+}
+
+static void DrawMinimap(const RenderState& rs)
+{
+	for (int y = 0; y != MAPH; y++)
+		for (int x = 0; x != MAPW; x++)
+			if (rs.map[y*MAPW+x] == '#')
+				ZL_Display::FillRect((float)x, (float)y, x+1.f, y+1.f, ZL_Color::Gray);
+	ZL_Vector playerpos = rs.playerpos.ToXY();
+	ZL_Vector playerfwd = ViewDir.ToXY().Norm()*.4f, playerside = playerfwd.VecPerp()*.8f;
+	ZL_Display::FillTriangle(playerpos-playerside-playerfwd, playerpos+playerside-playerfwd, playerpos+playerfwd, ZLWHITE);
+	//ZL_Display::FillCircle(playerpos.x, playerpos.y, player.radius, ZL_Color::White);
+	//ZL_Display::FillWideLine(playerpos.ToXY(), playerpos.ToXY() + player.dir.ToXY().Norm(), player.radius*.25f, ZL_Color::White);
+	const std::vector<RenderThing>* enemies[] = { &rs.spiders, &rs.bats, &rs.ghosts };
+	for (const std::vector<RenderThing>* list : enemies)
+		for (const RenderThing& t : *list)
+		{
+			ZL_Display::FillCircle(t.pos.ToXY(), .2f, ZL_Color::Red);
+			//ZL_Display::FillWideLine(e.mtx.GetTranslateXY(), e.movetarget, .1f, ZL_Color::Red);
 		}
+}
+
+static void FaceCamera(const ZL_Vector3& pos, float& yaw, float& pitch)
+{
+	ZL_Vector dXY = (Camera.GetPosition().ToXY() - pos.ToXY());
+	yaw = dXY.GetAngle() + PIHALF;
+	ZL_Vector d2 = ZL_Vector(dXY.GetLength(), Camera.GetPosition().z - pos.z);
+	pitch = PIHALF+d2.GetRelAngle(ZLV(1,0));
+}
+
+template <class E> static void DrawEnemies(const std::vector<RenderThing>& list)
+{
+	const ZL_Mesh& mesh = EnemyBehavior<E>::Mesh(GovernorLevels[Governor.level].enemyshadows);
+	for (const RenderThing& t : list)
+	{
+		float yaw, pitch;
+		FaceCamera(t.pos, yaw, pitch);
+		RenderList.Add(mesh, ZL_Matrix::MakeRotateTranslate(EnemyBehavior<E>::Rotation(t.movespeed, yaw, pitch), t.pos));
+		#ifdef ZILLALOG
+		if (ZL_Input::Held(ZLK_LCTRL)) RenderList.Add(MeshDbgSphere, ZL_Matrix::MakeTranslateScale(t.pos, t.radius));
+		#endif
 	}
+}
+
+// What each simulation event looks and sounds like, player damage only shows as the red flash of lasthit
+static const struct { ZL_Sound* sound; ZL_ParticleEmitter* particles; int count; bool colored; } EventEffects[SimEvent::COUNT] =
+{
+	{ &sndBullet, NULL,             0,   false }, //SHOT
+	{ &sndJump,   NULL,             0,   false }, //JUMP
+	{ &sndHit,    &ParticleDamage,  50,  false }, //HIT
+	{ &sndHit2,   &ParticleDestroy, 200, true  }, //KILL
+	{ NULL,       &ParticleDamage,  10,  false }, //WALL_HIT
+	{ NULL,       NULL,             0,   false }, //PLAYER_DAMAGED
+	{ NULL,       &ParticleDestroy, 200, true  }, //PLAYER_KILLED
+};
+enum { EVENT_PARTICLE_BUDGET = 600 };
 
-	for (Enemy& e : enemies)
+static void PlayEvents(const RenderState& rs)
+{
+	// each sound plays at most once per frame and all bursts share one particle budget, so a large volley costs the same as a few hits
+	bool played[SimEvent::COUNT] = { false };
+	int budget = EVENT_PARTICLE_BUDGET;
+	for (const SimEvent& ev : rs.events)
 	{
-		ZL_Vector3 emove;
-		switch (e.type)
+		const auto& fx = EventEffects[ev.type];
+		if (fx.sound && !played[ev.type]) { PlaySound(*fx.sound); played[ev.type] = true; }
+		if (!fx.particles || budget <= 0) continue;
+		int pcount = ParticleCount(fx.count, budget);
+		for (int pn = 0; pn != pcount; pn++)
 		{
-			case Thing::ENEMY_SPIDER:
-				e.movetarget = AStarMoveTarget(e.mtx.GetTranslateXY(), player.mtx.GetTranslateXY());
-				emove = ZL_Vector3((e.movetarget - e.mtx.GetTranslateXY()).Norm(), 0);
-				e.vel.z = 0;
-				break;
-			case Thing::ENEMY_BAT:
-			case Thing::ENEMY_GHOST:
-			{
-				ZL_Vector3 epos = e.mtx.GetTranslate();
-				ZL_Vector eposxy = epos.ToXY();
-				for (const Enemy& e2 : enemies)
-				{
-					ZL_Vector3 d = epos - e2.mtx.GetTranslate();
-					float distSq = d.GetLengthSq();
-					if (distSq < 0.01 || distSq > ZL_Math::Square(e.radius + e2.radius)) continue;
-					float back = (e.radius + e2.radius) - ssqrt(distSq);
-					e.mtx.TranslateBy(d.VecNorm() * back);
-				}
-				float targetheight = VIEW_HEIGHT;
-				if (epos.z < 2.0f && player.mtx.GetTranslateXY().GetDistance(eposxy) > 5) targetheight = 2.0f;
-				emove = ZL_Vector3(player.mtx.GetTranslate() + ZLV3(0, 0, targetheight) - epos).Norm();
-				break;
-			}
-			default:break;
+			if (fx.colored) fx.particles->SetColor(ZL_Color(RenderRand.Range(0.f, 1.f), RenderRand.Range(0.f, 1.f), RenderRand.Range(0.f, 1.f)), false);
+			fx.particles->Spawn(ev.pos + ZLV3(RenderRand.Range(-ev.radius, ev.radius), RenderRand.Range(-ev.radius, ev.radius), RenderRand.Range(-ev.radius, ev.radius)));
 		}
-		e.vel = ZL_Vector3::Lerp(e.vel, emove*e.movespeed, dt);
-		DoMove(e, dt);
+	}
+}
 
-		ZL_Vector3 diff = e.mtx.GetTranslate() - player.mtx.GetTranslate();
-		float distSq = diff.GetLengthSq();
-		if (distSq < ZL_Math::Square(e.radius + player.radius + .1f) && CalcAttackCount(dt, e.attacktimer, e.attackspeed, true))
+static ZL_Vector SunAngle()
+{
+	ZL_Vector lightang = ZL_Vector::FromAngle(ZLTICKS*.0001f);
+	if (lightang.y < 0) { lightang = -lightang; }
+	return lightang;
+}
+
+static void DrawSky(const ZL_Vector& lightang)
+{
+	ZL_Color sky = ZL_Color::Lerp(ZLRGB(.2f,.1f,.0), ZLRGB(0,0,.4), lightang.y);
+	ZL_Display::FillGradient(0, 0, ZLWIDTH, ZLHEIGHT, sky, sky, ZLRGB(.4,.4,.4), ZLRGB(.4,.4,.4));
+}
+
+// Minimap, status bar and messages, these are also all that is drawn of a frozen game over screen
+static void DrawHud(const RenderState& rs, int minimapframes)
+{
+#if 1
+	ZL_Rectf minimap(ZLFROMW(200), ZLFROMH(200), ZLFROMW(20), ZLFROMH(20));
+	if (ZL_Input::Held(ZLK_LCTRL)) minimap = ZL_Rectf(ZLFROMW(600), ZLFROMH(600), ZLFROMW(20), ZLFROMH(20));
+
+	static int minimapage;
+	if (minimapframes == 1)
+	{
+		ZL_Display::FillRect(minimap, ZL_Color::Black);
+		ZL_Display::PushOrtho(0,s(MAPW),0,s(MAPH));
+		ZL_Display::Translate(minimap.left * MAPW / ZLWIDTH, minimap.low * MAPH / ZLHEIGHT);
+		ZL_Display::Scale(minimap.Width()/ZLWIDTH, minimap.Height()/ZLHEIGHT);
+		DrawMinimap(rs);
+		ZL_Display::PopOrtho();
+		minimapage = minimapframes;
+	}
+	else
+	{
+		// at reduced quality the minimap is rendered into a texture only every few frames
+		if (minimapage++ >= minimapframes - 1)
 		{
-			player.lasthit = ZLTICKS;
-			player.health -= e.attackdamage;
-			if (player.health <= 0)
-			{
-				ZL_Vector3 ppos = player.mtx.GetTranslate();
-				float prad = player.radius * .5f;
-				for (int pn = 0; pn != 200; pn++)
-				{
-					ParticleDestroy.SetColor(RAND_COLOR, false);
-					ParticleDestroy.Spawn(ZLV3(RAND_RANGE(ppos.x-prad, ppos.x+prad), RAND_RANGE(ppos.y-prad, ppos.y+prad), RAND_RANGE(ppos.z-prad, ppos.z+prad)));
-				}
-				bullets.clear();
-				gameover = ZLTICKS;
-				return;
-			}
-			ZL_Vector3 pushback = diff.ToXY().Norm();
-			player.vel -= pushback * 1.0f;
-			e.vel += pushback * 1.0f;
+			srfMinimap.RenderToBegin(true);
+			ZL_Display::PushOrtho(0,s(MAPW),0,s(MAPH));
+			ZL_Display::FillRect(0, 0, s(MAPW), s(MAPH), ZL_Color::Black);
+			DrawMinimap(rs);
+			ZL_Display::PopOrtho();
+			srfMinimap.RenderToEnd();
+			minimapage = 0;
 		}
+		srfMinimap.DrawTo(minimap.left, minimap.low, minimap.right, minimap.high);
 	}
-}
 
-static void DrawTextBordered(const ZL_Vector& p, const char* txt, scalar scale = 1, const ZL_Color& colfill = ZLWHITE, const ZL_Color& colborder = ZLBLACK, int border = 2, ZL_Origin::Type origin = ZL_Origin::Center)
-{
-	for (int i = 0; i < 9; i++) if (i != 4) fntBig.Draw(p.x+(border*((i%3)-1)), p.y+8+(border*((i/3)-1)), txt, scale, scale, colborder, origin);
-	fntBig.Draw(p.x  , p.y+8  , txt, scale, scale, colfill, origin);
+	ZL_Display::DrawRect(0, 0, ZLWIDTH, 30, ZLBLACK, ZLLUMA(1,.5));
+	fntMain.Draw(10,10, DrawFormat("Wave: %d", rs.wave), ZLBLACK);
+	fntMain.Draw(100,10, DrawFormat("Enemies: %d", rs.enemiesleft), ZLBLACK);
+	fntMain.Draw(210,10,"Health:", ZLBLACK);
+	float healthbarx = 280, healthbarwidth = ZLFROMW(10) - healthbarx;
+	ZL_Display::FillRect(healthbarx-2, 6, healthbarx+healthbarwidth+2, 24, ZLBLACK);
+	if (rs.health > 0)
+		ZL_Display::FillRect(healthbarx, 8, healthbarx+healthbarwidth*(rs.health/rs.maxhealth), 22, ZL_Color::Blue);
+	float lasthit = ZLSINCE(rs.lasthit)*0.01f;
+	if (lasthit < 1)
+	{
+		ZL_Display::FillRect(0, 0, ZLWIDTH, ZLHEIGHT, ZL_Color(1,0,0,.3f-(.3f*lasthit)));
+	}
+#endif
+
+	if (rs.gameover)
+	{
+		float t = ZL_Math::Clamp01(ZLSINCESECONDS(rs.gameover)*.5f);
+		float x = (t < .5 ? 1.0f-0.5f*ZL_Easing::InOutQuad(t/.5f) : .5f);
+		DrawTextBordered(ZLV(ZLWIDTH*x, ZLHALFH) , "Game Over!", 2);
+		DrawTextBordered(ZLV(ZLWIDTH*x, ZLHALFH-60), DrawFormat("Defeated Enemies: %d", rs.kills));
+		DrawTextBordered(ZLV(ZLWIDTH*x, ZLHALFH - 250), "Press Space to return to Title", 1);
+	}
+	else if (rs.waveticks)
+	{
+		float wavet = ZLSINCESECONDS(rs.waveticks);
+		if (wavet >= 0 && wavet < 2)
+		{
+			float t = ZL_Math::Clamp01(wavet*.5f);
+			float x = (t < .3 ? 1.0f-0.5f*ZL_Easing::InOutQuad(t/.3f) : (t < .6f ? 0.5f : 0.5f-ZL_Easing::InOutQuad((t-.6f)/.3f)));
+			DrawTextBordered(ZLV(ZLWIDTH*x, ZLHALFH) , "You Win!", 2);
+		}
+		if (wavet >= 2 && wavet < 4)
+		{
+			float t = ZL_Math::Clamp01((wavet-2)*.5f);
+			float x = (t < .3 ? 1.0f-0.5f*ZL_Easing::InOutQuad(t/.3f) : (t < .6f ? 0.5f : 0.5f-ZL_Easing::InOutQuad((t-.6f)/.3f)));
+			DrawTextBordered(ZLV(ZLWIDTH*x, ZLHALFH+55), DrawFormat("Wave: %d", rs.wave), 2);
+			DrawTextBordered(ZLV(ZLWIDTH*x, ZLHALFH-60), DrawFormat("Enemies: %d", rs.enemiesleft), 1);
+		}
+	}
 }
 
-static void Draw()
+static void Draw(const RenderState& rs)
 {
-	if (IsTitle)
+	DrawArena.Reset();
+	if (rs.title)
 	{
 		float spx = s((ZLTICKS % 600)/3);
 		float spr = ssin(ZLTICKS*.03f)*.1f;
-		MeshWall.GetMaterial().GetDiffuseTexture().DrawTo(0, 0, ZLWIDTH, ZLHEIGHT);
-		ZL_Surface srfSpider = MeshSpider.GetMaterial().GetDiffuseTexture();
-		for (int i = 0; i != 10; i++)
+		if (AssetLoad.step > LOAD_WALLS) MeshWall.GetMaterial().GetDiffuseTexture().DrawTo(0, 0, ZLWIDTH, ZLHEIGHT);
+		else ZL_Display::ClearFill(ZL_Color::Brown);
+		ZL_Surface srfSpider = (AssetLoad.step > LOAD_ENEMIES ? MeshSpider.GetMaterial().GetDiffuseTexture() : ZL_Surface());
+		for (int i = 0; srfSpider && i != 10; i++)
 		{
 			srfSpider.Draw(50+10, -10-200 + spx + i * 200.0f, PI + spr, ZLLUMA(0,.5));
 			srfSpider.Draw(50, -200 + spx + i * 200.0f, PI + spr);
@@ -721,186 +2439,539 @@ static void Draw()
 		DrawTextBordered(ZLV(ZLHALFW, ZLHALFH - 220), "Press Space to Start!");
 
 		DrawTextBordered(ZLV(ZLHALFW, 30), "(C) 2022 - Bernhard Schelling");
-
-		if (ZL_Input::Down(ZLK_SPACE) || ZL_Input::Down(ZL_BUTTON_LEFT) || ZL_Input::Down(ZL_BUTTON_RIGHT))
-		{
-			Reset();
-			IsTitle = false;
-		}
-		if (ZL_Input::Down(ZLK_ESCAPE))
-		{
-			ZL_Application::Quit();
-		}
 		return;
 	}
 
-	if (ZL_Input::Down(ZLK_ESCAPE)) IsTitle = true;
-	#ifdef ZILLALOG
-	if (ZL_Input::Down(ZLK_F5)) waveticks = ZLTICKS;
-	#endif
-
+	PlayEvents(rs);
 	ParticleDamage.Update(Camera);
 	ParticleDestroy.Update(Camera);
 
-	ZL_Vector3 campos = player.mtx.GetTranslate(), camdir = player.dir;
-	campos.z += VIEW_HEIGHT;
-	if (gameover)
-	{
-		float got = ZL_Math::Clamp01(ZLSINCESECONDS(gameover));
-		campos.z = ZL_Math::Lerp(campos.z, .1f, got);
-		camdir = ZL_Vector3::Lerp(camdir, ZL_Vector3::Up, got).Norm();
-	}
-
-	ZL_Vector lightang = ZL_Vector::FromAngle(ZLTICKS*.0001f);
-	if (lightang.y < 0) { lightang = -lightang; }
+	ZL_Vector lightang = SunAngle();
 	ZL_Vector lightctr = ZLV(MAPW*.5f,MAPH*.5f);
 	LightSun.SetLookAt(ZLV3(lightctr.x - MAPW*1.3f * lightang.x, lightctr.y - MAPH*1.3f * lightang.x , 2 + 22 * lightang.y), ZLV3(MAPW*.45f,MAPH*.45f,.1));
 	LightSun.SetColor(ZLRGB(.4,.4,.4));
 	LightPlayer.SetPosition(Camera.GetPosition());
 	Camera.SetAmbientLightColor(ZL_Color::Lerp(ZLRGB(.2f,.1f,.0), ZLRGB(.2,.2,.2), lightang.y));
-	Camera.SetLookAt(campos, campos + camdir);
 
-	ZL_Color sky = ZL_Color::Lerp(ZLRGB(.2f,.1f,.0), ZLRGB(0,0,.4), lightang.y);
-	ZL_Display::FillGradient(0, 0, ZLWIDTH, ZLHEIGHT, sky, sky, ZLRGB(.4,.4,.4), ZLRGB(.4,.4,.4));
-	RenderList.Reset();
-	for (Bullet& b : bullets)
+	// the view direction is owned by the main thread and already has this frame's mouse look applied
+	ZL_Vector3 campos = rs.playerpos, camdir = ViewDir;
+	campos.z += VIEW_HEIGHT;
+	if (rs.gameover)
 	{
-		ZL_Vector dXY = (Camera.GetPosition().ToXY() - b.mtx.GetTranslateXY());
-		float yaw = dXY.GetAngle() + PIHALF;
-		ZL_Vector d2 = ZL_Vector(dXY.GetLength(), Camera.GetPosition().z - b.mtx.GetTranslate().z);
-		float pitch = PIHALF+d2.GetRelAngle(ZLV(1,0));
-		b.mtx.SetRotate(ZL_Quat::FromRotateZ(yaw) * ZL_Quat::FromRotateX(pitch));
-
-		RenderList.Add(MeshBullet, b.mtx);
+		float got = ZL_Math::Clamp01(ZLSINCESECONDS(rs.gameover));
+		campos.z = ZL_Math::Lerp(campos.z, .1f, got);
+		camdir = ZL_Vector3::Lerp(camdir, ZL_Vector3::Up, got).Norm();
 	}
+	Camera.SetLookAt(campos, campos + camdir);
 
-	for (Enemy& e : enemies)
-	{
-		ZL_Vector dXY = (Camera.GetPosition().ToXY() - e.mtx.GetTranslateXY());
-		float yaw = dXY.GetAngle() + PIHALF;
-		ZL_Vector d2 = ZL_Vector(dXY.GetLength(), Camera.GetPosition().z - e.mtx.GetTranslate().z);
-		float pitch = PIHALF+d2.GetRelAngle(ZLV(1,0));
+	DrawSky(lightang);
+	static unsigned int mapversion;
+	bool mapchanged = (mapversion != rs.mapversion);
+	if (mapchanged) { BuildWallMatrices(rs); mapversion = rs.mapversion; }
+	if (UpdateWallLod(campos.ToXY()) || mapchanged) BuildMapRenderList();
 
-		switch (e.type)
-		{
-			case Thing::ENEMY_SPIDER:
-				e.mtx.SetRotate(ZL_Quat::FromRotateZ(yaw + ssin(ZLTICKS*e.movespeed*.01f)*.1f) * ZL_Quat::FromRotateX(.5f));
-				RenderList.Add(MeshSpider, e.mtx);
-				break;
-			case Thing::ENEMY_BAT:
-				e.mtx.SetRotate(ZL_Quat::FromRotateZ(yaw) * ZL_Quat::FromRotateX(pitch + ssin(ZLTICKS*e.movespeed*.01f)*.5f));
-				RenderList.Add(MeshBat, e.mtx);
-				break;
-			case Thing::ENEMY_GHOST:
-				e.mtx.SetRotate(ZL_Quat::FromRotateZ(yaw) * ZL_Quat::FromRotateX(pitch));
-				RenderList.Add(MeshGhost, e.mtx);
-				break;
-			default:break;
-		}
-		#ifdef ZILLALOG
-		if (ZL_Input::Held(ZLK_LCTRL)) RenderList.Add(MeshDbgSphere, ZL_Matrix::MakeTranslateScale(e.mtx.GetTranslate(), e.radius));
-		#endif
+	RenderList.Reset();
+	for (const RenderThing& t : rs.bullets)
+	{
+		float yaw, pitch;
+		FaceCamera(t.pos, yaw, pitch);
+		RenderList.Add(MeshBullet, ZL_Matrix::MakeRotateTranslate(ZL_Quat::FromRotateZ(yaw) * ZL_Quat::FromRotateX(pitch), t.pos));
 	}
+	DrawEnemies<EnemySpider>(rs.spiders);
+	DrawEnemies<EnemyBat>(rs.bats);
+	DrawEnemies<EnemyGhost>(rs.ghosts);
 
 	RenderList.Add(ParticleDamage, ZL_Matrix::Identity);
 	RenderList.Add(ParticleDestroy, ZL_Matrix::Identity);
+	int things = (int)RenderThingCount(rs);
+	MetricSet(METRIC_RENDER_ENTRIES, RenderListMapEntries + things + 2);
+	MetricSet(METRIC_TRIANGLES, WallLod.triangles + things * TRIANGLES_SPRITE);
+	Perf.triangles = WallLod.triangles + things * TRIANGLES_SPRITE;
+	Perf.trianglesfull = WallLod.trianglesfull + things * TRIANGLES_SPRITE;
 
 	//ZL_Display3D::DrawListsWithLight(RenderLists, COUNT_OF(RenderLists), Camera, LightSun);
+	double draw3dstart = TimeMs();
 	ZL_Display3D::DrawListsWithLights(RenderLists, COUNT_OF(RenderLists), Camera, Lights, COUNT_OF(Lights));
+	Perf.draw3dms = (float)(TimeMs() - draw3dstart);
 
-	if (!gameover)
+	if (!rs.gameover)
 		srfCrosshair.Draw(ZLHALFW, ZLHALFH-5);
 
-#if 1
-	ZL_Rectf minimap(ZLFROMW(200), ZLFROMH(200), ZLFROMW(20), ZLFROMH(20));
-	if (ZL_Input::Held(ZLK_LCTRL)) minimap = ZL_Rectf(ZLFROMW(600), ZLFROMH(600), ZLFROMW(20), ZLFROMH(20));
+	DrawHud(rs, GovernorLevels[Governor.level].minimapframes);
+}
 
-	ZL_Display::FillRect(minimap, ZL_Color::Black);
-	ZL_Display::PushOrtho(0,s(MAPW),0,s(MAPH));
-	ZL_Display::Translate(minimap.left * MAPW / ZLWIDTH, minimap.low * MAPH / ZLHEIGHT);
-	ZL_Display::Scale(minimap.Width()/ZLWIDTH, minimap.Height()/ZLHEIGHT);
-	for (int y = 0; y != MAPH; y++)
-		for (int x = 0; x != MAPW; x++)
-			if (Map[y*MAPW+x] == '#')
-				ZL_Display::FillRect((float)x, (float)y, x+1.f, y+1.f, ZL_Color::Gray);
-	ZL_Vector playerpos = player.mtx.GetTranslateXY();
-	ZL_Vector playerfwd = player.dir.ToXY().Norm()*.4f, playerside = playerfwd.VecPerp()*.8f;
-	ZL_Display::FillTriangle(playerpos-playerside-playerfwd, playerpos+playerside-playerfwd, playerpos+playerfwd, ZLWHITE);
-	//ZL_Display::FillCircle(playerpos.x, playerpos.y, player.radius, ZL_Color::White);
-	//ZL_Display::FillWideLine(playerpos.ToXY(), playerpos.ToXY() + player.dir.ToXY().Norm(), player.radius*.25f, ZL_Color::White);
-	for (Enemy& e : enemies)
+static void StartStress()
+{
+	GameState& g = Game;
+	Reset(g);
+	ViewDir = g.player.dir;
+	if (Net.active) NetReset();
+	IsTitle = false;
+	g.wave = 1;
+	StartWave(g);
+	FadeWalls(g, 1);
+	g.wavespawns = 0;
+	g.waveticks = ZLTICKS - 5000; //skip the wave intro
+	for (int i = 0; i != Stress.spiders; i++) SpawnEnemy(g, Thing::ENEMY_SPIDER);
+	for (int i = 0; i != Stress.bats; i++) SpawnEnemy(g, Thing::ENEMY_BAT);
+	for (int i = 0; i != Stress.ghosts; i++) SpawnEnemy(g, Thing::ENEMY_GHOST);
+	Perf.log = true;
+	Perf.reporttime = TimeMs();
+	printf("Stress mode: %d spiders, %d bats, %d ghosts, %.1f shots per second%s\n", Stress.spiders, Stress.bats, Stress.ghosts, 1 / Stress.weapondelay, (Stress.invulnerable ? ", invulnerable" : ""));
+}
+
+static void PerfFrame(float workms, float framems)
+{
+	static FrameTimes worktimes, simtimes, frametimes, draw3dtimes;
+	worktimes.Add(workms);
+	simtimes.Add(SimThread.ms);
+	frametimes.Add(framems);
+	draw3dtimes.Add(Perf.draw3dms);
+	double now = TimeMs();
+	if (now - Perf.reporttime < PERF_REPORT_SECONDS * 1000) return;
+	Perf.reporttime = now;
+	printf("Perf wave %d: %d enemies, %d bullets, shadows %s\n", Game.wave, EnemyCount(Game), (int)Game.bullets.size(), (Perf.shadows ? "on" : "off"));
+	worktimes.Report((SimThread.pipelined ? "main thread (wait+draw)" : "update+draw"));
+	simtimes.Report("simulation");
+	frametimes.Report("frame interval");
+	draw3dtimes.Report("3d draw call"); //the shadow pass cost is the difference to a run with -noshadows
+	printf("    triangles submitted: %d (%d without wall LOD)\n", Perf.triangles, Perf.trianglesfull);
+	fflush(stdout);
+}
+
+static void GovernorResetWindow()
+{
+	Governor.frames = Governor.overframes = 0;
+	Governor.workms = 0;
+}
+
+static void GovernorFrame(float workms, float framems)
+{
+	if (Governor.budgetms <= 0) return;
+	Governor.workms += workms;
+	if (workms > Governor.budgetms * .8f || framems > Governor.budgetms * 1.25f) Governor.overframes++;
+	if (++Governor.frames != GOVERNOR_WINDOW) return;
+
+	float avgms = (float)(Governor.workms / GOVERNOR_WINDOW), overratio = Governor.overframes / (float)GOVERNOR_WINDOW;
+	int oldlevel = Governor.level, maxlevel = (int)COUNT_OF(GovernorLevels) - 1;
+	if (overratio > .25f) Governor.level = ZL_Math::Min(Governor.level + 1, maxlevel), Governor.calmwindows = 0;
+	else if (!Governor.overframes && avgms < Governor.budgetms * .5f && ++Governor.calmwindows >= 3) Governor.level = ZL_Math::Max(Governor.level - 1, 0), Governor.calmwindows = 0;
+	else if (Governor.overframes) Governor.calmwindows = 0;
+	if (Governor.level != oldlevel)
 	{
-		ZL_Display::FillCircle(e.mtx.GetTranslateXY(), .2f, ZL_Color::Red);
-		//ZL_Display::FillWideLine(e.mtx.GetTranslateXY(), e.movetarget, .1f, ZL_Color::Red);
+		printf("Governor: quality level %d -> %d (update+draw avg %.2f ms of %.2f ms budget, %d%% of frames over)\n", oldlevel, Governor.level, avgms, Governor.budgetms, (int)(overratio * 100));
+		fflush(stdout);
 	}
+	GovernorResetWindow();
+}
 
-	ZL_Display::PopOrtho();
+static struct sAllocCheck
+{
+	float seconds = 0, warmup = 3;
+	double start = 0;
+	unsigned int last = 0;
+	int frames = 0, failedframes = 0, allocations = 0;
+} AllocCheck;
 
-	ZL_Display::DrawRect(0, 0, ZLWIDTH, 30, ZLBLACK, ZLLUMA(1,.5));
-	fntMain.Draw(10,10, *ZL_String::format("Wave: %d", wave), ZLBLACK);
-	fntMain.Draw(100,10, *ZL_String::format("Enemies: %d", wavespawns + (int)enemies.size()), ZLBLACK);
-	fntMain.Draw(210,10,"Health:", ZLBLACK);
-	float healthbarx = 280, healthbarwidth = ZLFROMW(10) - healthbarx;
-	ZL_Display::FillRect(healthbarx-2, 6, healthbarx+healthbarwidth+2, 24, ZLBLACK);
-	if (player.health > 0)
-		ZL_Display::FillRect(healthbarx, 8, healthbarx+healthbarwidth*(player.health/player.maxhealth), 22, ZL_Color::Blue);
-	float lasthit = ZLSINCE(player.lasthit)*0.01f;
-	if (lasthit < 1)
+static void AllocCheckFrame()
+{
+	unsigned int count = HeapAllocations.load(), n = count - AllocCheck.last;
+	AllocCheck.last = count;
+	double t = (TimeMs() - AllocCheck.start) / 1000;
+	if (t < AllocCheck.warmup) return;
+	AllocCheck.frames++;
+	if (n)
 	{
-		ZL_Display::FillRect(0, 0, ZLWIDTH, ZLHEIGHT, ZL_Color(1,0,0,.3f-(.3f*lasthit)));
+		if (AllocCheck.failedframes < 10) printf("Alloc check: frame %d made %u heap allocations\n", AllocCheck.frames, n);
+		AllocCheck.failedframes++;
+		AllocCheck.allocations += n;
 	}
-#endif
+	if (t < AllocCheck.warmup + AllocCheck.seconds) return;
+	printf("Alloc check: %d of %d steady state frames allocated (%d allocations), peak frame arena use %d bytes - %s\n",
+		AllocCheck.failedframes, AllocCheck.frames, AllocCheck.allocations, (int)Game.arena.peak, (AllocCheck.failedframes ? "FAILED" : "OK"));
+	fflush(stdout);
+	ZL_Application::Quit(AllocCheck.failedframes ? 1 : 0);
+	AllocCheck.seconds = 0;
+}
+
+static void InputLatencyFrame()
+{
+	static FrameTimes latencies;
+	double now = TimeMs();
+	if (InputLatency.pending) latencies.Add((float)(now - InputLatency.pending));
+	InputLatency.pending = 0;
+	if (now - InputLatency.reporttime < PERF_REPORT_SECONDS * 1000) return;
+	InputLatency.reporttime = now;
+	printf("Input latency (input event to frame submit):\n");
+	latencies.Report("latency");
+	fflush(stdout);
+}
+
+static void IdleReport(double now)
+{
+	double seconds = (now - Idle.reporttime) / 1000;
+	if (seconds <= 0) return;
+	double cpums = (clock() - Idle.reportcpu) * 1000.0 / CLOCKS_PER_SEC;
+	printf("Idle %s: %.1f fps, cpu %.1f ms per second, draw %.2f ms per second\n", (Idle.frozen ? "game over (frozen)" : "title"), Idle.frames / seconds, cpums / seconds, Idle.drawms / seconds);
+	fflush(stdout);
+	Idle.reporttime = now;
+	Idle.reportcpu = clock();
+	Idle.frames = 0;
+	Idle.drawms = 0;
+}
+
+static void IdleFrame(const RenderState& rs, float workms)
+{
+	double now = TimeMs();
+	bool still = (rs.title || (rs.gameover && ZLSINCESECONDS(rs.gameover) > IDLE_GAMEOVER_SETTLE));
+	bool active = (Idle.fps > 0 && still && now - Idle.lastinput > Idle.delay * 1000);
+	if (Idle.active && workms >= 0) { Idle.frames++; Idle.drawms += workms; }
+	if (active == Idle.active)
+	{
+		if (active && Perf.log && now - Idle.reporttime >= PERF_REPORT_SECONDS * 1000) IdleReport(now);
+		return;
+	}
+	if (!active && Perf.log) IdleReport(now);
+	if (!active) GovernorResetWindow(); //the window would otherwise mix the frame limited idle frames with live ones
+	Idle.active = active;
+	Idle.frozen = false;
+	Idle.reporttime = now;
+	Idle.reportcpu = clock();
+	Idle.frames = 0;
+	Idle.drawms = 0;
+	ZL_Application::SetFpsLimit(active ? (int)Idle.fps : 60);
+}
 
-	if (gameover)
+static void DrawFrozen(const RenderState& rs)
+{
+	if (!Idle.frozen)
 	{
-		float got = ZLSINCESECONDS(gameover), gotold = ZLSINCESECONDS(gameover+ZLELAPSEDTICKS);
-		float t = ZL_Math::Clamp01(got*.5f);
-		float x = (t < .5 ? 1.0f-0.5f*ZL_Easing::InOutQuad(t/.5f) : .5f);
-		DrawTextBordered(ZLV(ZLWIDTH*x, ZLHALFH) , "Game Over!", 2);
-		DrawTextBordered(ZLV(ZLWIDTH*x, ZLHALFH-60), *ZL_String::format("Defeated Enemies: %d", kills));
-		DrawTextBordered(ZLV(ZLWIDTH*x, ZLHALFH - 250), "Press Space to return to Title", 1);
-		if (got > 1.0)
-		{
-			if (ZL_Input::Down(ZLK_SPACE) || ZL_Input::Down(ZL_BUTTON_LEFT) || ZL_Input::Down(ZL_BUTTON_RIGHT))
-				IsTitle = true;
-		}
+		// render target surfaces have no depth buffer so the 3D scene is left out, the camera looks up into the sky by now anyway
+		if (!Idle.srfFrozen || Idle.srfFrozen.GetWidth() != (int)ZLWIDTH || Idle.srfFrozen.GetHeight() != (int)ZLHEIGHT)
+			Idle.srfFrozen = ZL_Surface((int)ZLWIDTH, (int)ZLHEIGHT);
+		Idle.srfFrozen.RenderToBegin(true);
+		DrawSky(SunAngle());
+		DrawHud(rs, 1); //the minimap is drawn directly, render targets cannot be nested
+		Idle.srfFrozen.RenderToEnd();
+		Idle.frozen = true;
+	}
+	Idle.srfFrozen.DrawTo(0, 0, ZLWIDTH, ZLHEIGHT);
+}
+
+struct MetricsAggregate
+{
+	void Add(const long long* frame)
+	{
+		frames++;
+		for (int i = 0; i != METRIC_COUNT; i++) { sum[i] += frame[i]; if (frame[i] > max[i]) max[i] = frame[i]; }
+	}
+	int frames;
+	long long sum[METRIC_COUNT], max[METRIC_COUNT];
+};
+
+struct MetricsRow
+{
+	const char* kind;
+	int index, wave;
+	float time;
+	MetricsAggregate agg;
+};
+
+// Finished rows are streamed to the file as they complete so nothing accumulates in memory during long runs
+static struct sMetrics
+{
+	const char* path = NULL;
+	FILE* file = NULL;
+	bool json = false;
+	long filesize = 0;
+	double start = 0, secondstart = 0;
+	int seconds = 0, wave = 0, written = 0;
+	MetricsAggregate secondagg, waveagg;
+} Metrics;
+static volatile sig_atomic_t MetricsDumpRequested;
+
+static void MetricsWriteRow(FILE* f, bool json, bool first, const MetricsRow& r)
+{
+	const MetricsAggregate& a = r.agg;
+	if (json) fprintf(f, "%s\n\t{ \"kind\": \"%s\", \"index\": %d, \"wave\": %d, \"time\": %.3f, \"frames\": %d", (first ? "" : ","), r.kind, r.index, r.wave, r.time, a.frames);
+	else fprintf(f, "%s,%d,%d,%.3f,%d", r.kind, r.index, r.wave, r.time, a.frames);
+	for (int i = 0; i != METRIC_COUNT; i++)
+	{
+		bool gauge = (i >= METRIC_FIRST_GAUGE);
+		double total = (gauge ? (a.frames ? a.sum[i] / (double)a.frames : 0) : (double)a.sum[i]);
+		if (json) fprintf(f, ", \"%s_%s\": %.2f, \"%s_max\": %lld", MetricNames[i], (gauge ? "avg" : "total"), total, MetricNames[i], a.max[i]);
+		else fprintf(f, ",%.2f,%lld", total, a.max[i]);
+	}
+	fprintf(f, (json ? " }" : "\n"));
+}
+
+static void MetricsAddRow(const MetricsRow& r)
+{
+	MetricsWriteRow(Metrics.file, Metrics.json, !Metrics.written++, r);
+}
+
+// Appends the unfinished rows and the closing bracket so the file is complete, on a signal the file position is then
+// moved back so the following rows overwrite them again (leftovers of a longer earlier tail are padded with newlines)
+static void MetricsDump(bool close)
+{
+	FILE* f = Metrics.file;
+	if (!f) return;
+	long tail = ftell(f);
+	int written = Metrics.written;
+	float now = (float)((TimeMs() - Metrics.start) / 1000);
+	MetricsRow partial[2] = { { "second", Metrics.seconds, Metrics.wave, now, Metrics.secondagg }, { "wave", Metrics.wave, Metrics.wave, now, Metrics.waveagg } };
+	for (const MetricsRow& r : partial) if (r.agg.frames) MetricsWriteRow(f, Metrics.json, !written++, r);
+	if (Metrics.json) fprintf(f, "\n]\n");
+	long end = ftell(f);
+	if (close)
+	{
+		for (; end < Metrics.filesize; end++) fputc('\n', f);
+		fclose(f);
+		Metrics.file = NULL;
+		return;
 	}
+	if (end > Metrics.filesize) Metrics.filesize = end;
+	fflush(f);
+	fseek(f, tail, SEEK_SET);
+}
+
+static void MetricsExit()
+{
+	MetricsDump(true);
+}
+
+static void MetricsSignal(int)
+{
+	MetricsDumpRequested = 1;
+}
+
+static void MetricsInit(const char* path)
+{
+	FILE* f = fopen(path, "w");
+	if (!f) { printf("Could not open metrics file %s\n", path); return; }
+	size_t pathlen = strlen(path);
+	Metrics.json = (pathlen > 5 && !strcmp(path + pathlen - 5, ".json"));
+	if (Metrics.json) fprintf(f, "[");
 	else
 	{
-		if (waveticks == 0) { waveticks = ZLTICKS-2000; }
+		fprintf(f, "kind,index,wave,time,frames");
+		for (int i = 0; i != METRIC_COUNT; i++) fprintf(f, ",%s_%s,%s_max", MetricNames[i], (i >= METRIC_FIRST_GAUGE ? "avg" : "total"), MetricNames[i]);
+		fprintf(f, "\n");
+	}
+	Metrics.path = path;
+	Metrics.file = f;
+	Metrics.start = Metrics.secondstart = TimeMs();
+	atexit(MetricsExit);
+	#ifdef SIGUSR1
+	signal(SIGUSR1, MetricsSignal);
+	#endif
+}
 
-		float wavet = ZLSINCESECONDS(waveticks), wavetold = ZLSINCESECONDS(waveticks+ZLELAPSEDTICKS);
-		if (wavet >= 0 && wavetold < 2)
-		{
-			float t = ZL_Math::Clamp01(wavet*.5f);
-			float x = (t < .3 ? 1.0f-0.5f*ZL_Easing::InOutQuad(t/.3f) : (t < .6f ? 0.5f : 0.5f-ZL_Easing::InOutQuad((t-.6f)/.3f)));
-			DrawTextBordered(ZLV(ZLWIDTH*x, ZLHALFH) , "You Win!", 2);
-			FadeWalls(1-t);
-		}
-		if (wavetold < 2.0f && wavet >= 2.0f)
+static void MetricsEndFrame()
+{
+	if (!Metrics.path) { memset(MetricsFrame, 0, sizeof(MetricsFrame)); return; }
+	MetricSet(METRIC_BULLETS, (long long)Game.bullets.size());
+	MetricSet(METRIC_ENEMIES, EnemyCount(Game));
+	double now = TimeMs();
+	float time = (float)((now - Metrics.start) / 1000);
+	if (Game.wave != Metrics.wave)
+	{
+		if (Metrics.waveagg.frames) MetricsAddRow({ "wave", Metrics.wave, Metrics.wave, time, Metrics.waveagg });
+		Metrics.waveagg = MetricsAggregate();
+		Metrics.wave = Game.wave;
+	}
+	Metrics.secondagg.Add(MetricsFrame);
+	Metrics.waveagg.Add(MetricsFrame);
+	memset(MetricsFrame, 0, sizeof(MetricsFrame));
+	if (now - Metrics.secondstart >= 1000)
+	{
+		MetricsAddRow({ "second", Metrics.seconds++, Metrics.wave, time, Metrics.secondagg });
+		Metrics.secondagg = MetricsAggregate();
+		Metrics.secondstart = now;
+	}
+	if (MetricsDumpRequested) { MetricsDumpRequested = 0; MetricsDump(false); }
+}
+
+static bool RunBenchmarks()
+{
+	GameState& g = Game;
+	bool ok = true;
+	printf("Snapshot benchmark (200 snapshots of synthetic movement each)\n");
+	for (int count : { 10, 100, 1000 })
+	{
+		Reset(g);
+		g.wave = 1;
+		g.thingids = 65536 - count / 2; //ids cross the 16 bit boundary to cover the wide gap encoding
+		while (EnemyCount(g) != count) SpawnEnemy(g);
+		ForEachEnemy(g, [&](Enemy& e) { e.vel = ZLV3(g.RandRange(-2, 2), g.RandRange(-2, 2), (e.type == Thing::ENEMY_SPIDER ? 0 : g.RandRange(-.5, .5))); });
+
+		Snapshot base, cur, decoded;
+		std::vector<unsigned char> data;
+		SnapshotCapture(g, cur, 1);
+		SnapshotEncode(base, cur, data);
+		size_t fullbytes = data.size(), deltabytes = 0;
+		double encodems = 0, decodems = 0;
+		int frames = 200, errors = 0;
+		base = cur;
+		for (int frame = 0; frame != frames; frame++)
 		{
-			wave++;
-			StartWave();
+			ForEachEnemy(g, [&](Enemy& e) { if (g.RandChance(4)) e.mtx.TranslateBy(e.vel * (1/60.0f)); }); //not everything moves every frame
+			g.player.mtx.TranslateBy(ZLV3(.01f, 0, 0));
+			SnapshotCapture(g, cur, (unsigned int)frame + 2);
+
+			double t0 = TimeMs();
+			SnapshotEncode(base, cur, data);
+			double t1 = TimeMs();
+			bool decodeok = SnapshotDecode(base, &data[0], data.size(), decoded);
+			double t2 = TimeMs();
+
+			if (!decodeok || decoded.tick != cur.tick || decoded.player != cur.player || decoded.things != cur.things) errors++;
+			encodems += t1 - t0;
+			decodems += t2 - t1;
+			deltabytes += data.size();
+			base = cur;
 		}
-		if (wavet >= 2 && wavetold < 4)
+		printf("  %4d enemies: full %6d bytes, delta %8.1f bytes/snapshot, encode %.4f ms, decode %.4f ms, round trip %s\n",
+			count, (int)fullbytes, deltabytes / (double)frames, encodems / frames, decodems / frames, (errors ? "FAILED" : "OK"));
+		if (errors) ok = false;
+	}
+
+	Reset(g);
+	g.wave = 1;
+	StartWave(g);
+	FadeWalls(g, 1);
+	while (EnemyCount(g) != 100) SpawnEnemy(g);
+	int rays = 100000, hits[2] = { 0, 0 };
+	double rayms[2];
+	for (int withenemies = 0; withenemies != 2; withenemies++)
+	{
+		double t0 = TimeMs();
+		for (int i = 0; i != rays; i++)
 		{
-			float t = ZL_Math::Clamp01((wavet-2)*.5f);
-			float x = (t < .3 ? 1.0f-0.5f*ZL_Easing::InOutQuad(t/.3f) : (t < .6f ? 0.5f : 0.5f-ZL_Easing::InOutQuad((t-.6f)/.3f)));
-			DrawTextBordered(ZLV(ZLWIDTH*x, ZLHALFH+55), *ZL_String::format("Wave: %d", wave), 2);
-			DrawTextBordered(ZLV(ZLWIDTH*x, ZLHALFH-60), *ZL_String::format("Enemies: %d", wavespawns + (int)enemies.size()), 1);
-			FadeWalls(t);
+			RayHit hit;
+			ZL_Vector3 from = ZLV3(g.RandRange(1, MAPW-1), g.RandRange(1, MAPH-1), g.RandRange(.1, 1)), dir = ZLV3(g.RandRange(-1, 1), g.RandRange(-1, 1), g.RandRange(-.2, .2)).Norm();
+			hits[withenemies] += RayCast(g, from, dir, 20, hit, !!withenemies);
 		}
-		float spawnspeed = 1.0f + wave / 30.0f;
-		if (wavet >= 5 && wavespawns && (int)(wavetold*spawnspeed) != (int)(wavet*spawnspeed))
+		rayms[withenemies] = TimeMs() - t0;
+	}
+	printf("Raycast benchmark (%d random rays, wave 1 maze)\n", rays);
+	printf("  walls only: %.3f us/ray (%d hits)\n", rayms[0] * 1000 / rays, hits[0]);
+	printf("  walls and 100 enemies: %.3f us/ray (%d hits)\n", rayms[1] * 1000 / rays, hits[1]);
+
+	Reset(g);
+	return ok;
+}
+
+// Many headless games simulated at once with a fixed time step, each worker thread reuses its own game state
+static struct sBatch
+{
+	int games = 0;
+	float maxseconds = 600;
+	long long waves, kills;
+} Batch;
+
+static void BatchGame(GameState& g, unsigned int seed)
+{
+	g.rand = ZL_SeededRand(seed);
+	Reset(g);
+	InputFrame in;
+	in.dt = 1/60.0f;
+	in.ticks = 10000;
+	for (int frame = 1; !g.gameover && frame < Batch.maxseconds * 60; frame++)
+	{
+		ticks_t ticks = 10000 + (ticks_t)(frame * 1000 / 60);
+		in.elapsedticks = ticks - in.ticks;
+		in.ticks = ticks;
+		g.arena.Reset();
+		Update(g, BotInput(g, in)); //an idle player would make every game a quick loss and say nothing about balancing
+	}
+}
+
+static double BatchRun(int threads)
+{
+	std::atomic<int> next(0);
+	std::atomic<long long> waves(0), kills(0);
+	auto worker = [&]()
+	{
+		GameState* g = new GameState();
+		g->headless = true;
+		g->asyncprep = false;
+		ReservePools(*g);
+		for (int i; (i = next++) < Batch.games;)
 		{
-			wavespawns--;
-			SpawnEnemy();
+			BatchGame(*g, (unsigned int)i + 1);
+			waves += g->wave;
+			kills += g->kills;
 		}
-		if (wavet >= 5 && !wavespawns && !enemies.size())
+		delete g;
+	};
+	double start = TimeMs();
+	#ifdef SHOOTZILLA_THREADS
+	std::vector<std::thread> workers;
+	for (int i = 1; i < threads; i++) workers.emplace_back(worker);
+	worker();
+	for (std::thread& t : workers) t.join();
+	#else
+	worker();
+	#endif
+	double seconds = (TimeMs() - start) / 1000;
+	Batch.waves = waves;
+	Batch.kills = kills;
+	return Batch.games / seconds;
+}
+
+static bool RunBatch()
+{
+	#ifdef SHOOTZILLA_THREADS
+	int threads = ZL_Math::Max((int)std::thread::hardware_concurrency(), 1);
+	#else
+	int threads = 1;
+	#endif
+	printf("Batch of %d headless bot games (at most %.0f simulated seconds each)\n", Batch.games, Batch.maxseconds);
+	double single = BatchRun(1);
+	long long waves = Batch.waves, kills = Batch.kills;
+	printf("  1 thread: %.2f games/sec\n", single);
+	double multi = BatchRun(threads);
+	printf("  %d threads: %.2f games/sec (%.2fx)\n", threads, multi, multi / single);
+	bool same = (waves == Batch.waves && kills == Batch.kills);
+	printf("  average wave %.2f, average kills %.2f, results of both runs %s\n", waves / (double)Batch.games, kills / (double)Batch.games, (same ? "match" : "DIFFER"));
+	return same;
+}
+
+// Bot games one after another without drawing and as fast as possible, -soak SECONDS of wall clock time
+static void RunSoak()
+{
+	GameState* g = new GameState();
+	g->headless = true;
+	g->asyncprep = false;
+	g->rand = ZL_SeededRand(ZL_Rand::UInt());
+	ReservePools(*g);
+	Soak.start = Soak.reporttime = TimeMs();
+	printf("Soak run of %.0f seconds with headless bot games\n", Bot.soakseconds);
+	InputFrame in;
+	in.dt = 1/60.0f;
+	in.ticks = 10000;
+	Reset(*g);
+	Soak.gamestart = in.ticks;
+	for (long long frame = 1; TimeMs() - Soak.start < Bot.soakseconds * 1000; frame++)
+	{
+		ticks_t ticks = 10000 + (ticks_t)(frame * 1000 / 60);
+		in.elapsedticks = ticks - in.ticks;
+		in.ticks = ticks;
+		g->arena.Reset();
+		double tickstart = TimeMs();
+		Update(*g, BotInput(*g, in));
+		Soak.times.Add((float)(TimeMs() - tickstart));
+		if (g->gameover)
 		{
-			waveticks = ZLTICKS;
+			SoakGameEnded(*g);
+			Reset(*g);
+			Soak.gamestart = in.ticks;
 		}
+		SoakReport(g->wave, "tick");
 	}
+	SoakReport(g->wave, "tick", true);
+	delete g;
 }
 
 static struct sShootzilla : public ZL_Application
@@ -909,24 +2980,112 @@ static struct sShootzilla : public ZL_Application
 
 	virtual void Load(int argc, char *argv[])
 	{
+		AssetLoad.start = TimeMs();
+		bool bench = false;
+		for (int i = 1; i < argc; i++)
+		{
+			if (!strcmp(argv[i], "-bench")) bench = true;
+			else if (!strcmp(argv[i], "-bot")) Bot.active = true;
+			else if (!strcmp(argv[i], "-soak") && i + 1 < argc) Bot.active = true, Bot.soakseconds = ZL_Math::Max((float)atof(argv[++i]), 1.0f);
+			else if (!strcmp(argv[i], "-batch") && i + 1 < argc) Batch.games = ZL_Math::Max(atoi(argv[++i]), 1);
+			else if (!strcmp(argv[i], "-stress") && i + 3 < argc) { Stress.active = true; Stress.spiders = atoi(argv[++i]); Stress.bats = atoi(argv[++i]); Stress.ghosts = atoi(argv[++i]); }
+			else if (!strcmp(argv[i], "-firerate") && i + 1 < argc) Stress.weapondelay = 1.0f / ZL_Math::Max((float)atof(argv[++i]), .1f);
+			else if (!strcmp(argv[i], "-invulnerable")) Stress.invulnerable = true;
+			else if (!strcmp(argv[i], "-hitscan")) Hitscan = true;
+			else if (!strcmp(argv[i], "-netsim") && i + 2 < argc) { Net.active = true; Net.rttms = (float)atof(argv[++i]); Net.loss = ZL_Math::Clamp01((float)atof(argv[++i]) / 100); }
+			else if (!strcmp(argv[i], "-perflog")) Perf.log = true;
+			else if (!strcmp(argv[i], "-noshadows")) Perf.shadows = false;
+			else if (!strcmp(argv[i], "-latency")) InputLatency.active = true;
+			else if (!strcmp(argv[i], "-metrics") && i + 1 < argc) MetricsInit(argv[++i]);
+			else if (!strcmp(argv[i], "-singlethread")) SimThread.pipelined = false;
+			else if (!strcmp(argv[i], "-nowarmup")) WarmUp.enabled = false;
+			else if (!strcmp(argv[i], "-idle") && i + 1 < argc) Idle.fps = ZL_Math::Max((float)atof(argv[++i]), 0.0f);
+			else if (!strcmp(argv[i], "-walllod") && i + 1 < argc) WallLod.distance = (float)atof(argv[++i]);
+			else if (!strcmp(argv[i], "-alloccheck") && i + 1 < argc) AllocCheck.seconds = ZL_Math::Max((float)atof(argv[++i]), 1.0f);
+			else if (!strcmp(argv[i], "-governor") && i + 1 < argc) Governor.budgetms = (float)atof(argv[++i]);
+			else if (!strcmp(argv[i], "-aibudget") && i + 1 < argc) AILod.budgetms = (float)atof(argv[++i]);
+			else if (!strcmp(argv[i], "-ailod") && i + 2 < argc) { AILod.distance = (float)atof(argv[++i]); AILod.interval = (unsigned int)ZL_Math::Max(atoi(argv[++i]), 1); }
+		}
+		#ifndef SHOOTZILLA_ALLOCCHECK
+		if (AllocCheck.seconds) { printf("Alloc check: heap allocation counting is not compiled in, build with SHOOTZILLA_ALLOCCHECK defined or as a debug build\n"); ZL_Application::Quit(1); return; }
+		#endif
+		if (AllocCheck.seconds && !Stress.active) { Stress.active = Stress.invulnerable = true; Stress.spiders = 40; Stress.bats = 20; Stress.ghosts = 10; }
+		if (AllocCheck.seconds) Bot.active = true; //let the bot shoot and kill so bullets, deaths, spawns and wave prep get checked too
+		ReservePools(Game);
+		ReserveRenderStates(Game);
+		if (bench) { ZL_Application::Quit(RunBenchmarks() ? 0 : 1); return; }
+		if (Batch.games) { ZL_Application::Quit(RunBatch() ? 0 : 1); return; }
+		if (Bot.soakseconds) { RunSoak(); ZL_Application::Quit(0); return; }
 		if (!ZL_Application::LoadReleaseDesktopDataBundle()) return;
 		if (!ZL_Display::Init("Shootzilla", 1280, 720, ZL_DISPLAY_ALLOWRESIZEHORIZONTAL | ZL_DISPLAY_DEPTHBUFFER)) return;
 		ZL_Display::ClearFill(ZL_Color::White);
 		ZL_Display::SetAA(true);
 		ZL_Display3D::Init(2);
-		ZL_Display3D::InitShadowMapping();
+		if (Perf.shadows) ZL_Display3D::InitShadowMapping();
 		ZL_Audio::Init();
 		ZL_Input::Init();
 		ZL_Display::SetPointerLock(true);
-		::Load();
-		::Reset();
+		ZL_Display::sigPointerMove.connect(this, &sShootzilla::OnPointerMove);
+		ZL_Display::sigPointerDown.connect(this, &sShootzilla::OnPointerDown);
+		ZL_Display::sigKeyDown.connect(this, &sShootzilla::OnKeyDown);
+		LoadStep(); //only the fonts, the title is shown while the rest is loaded
+		Game.rand = ZL_SeededRand(ZL_Rand::UInt());
+		Game.metrics = MetricsFrame;
+		::Reset(Game);
+		if (Stress.active) { LoadRemaining(); StartStress(); }
+		AllocCheck.start = Idle.lastinput = Soak.start = Soak.reporttime = TimeMs();
 	}
 
 	virtual void AfterFrame()
 	{
-		::Update(ZL_Math::Min(ZLELAPSED, .333f));
-		::Draw();
+		double framestart = TimeMs();
+		SimFinish();
+
+		// reports of the previous frame are made here while the simulation is idle
+		// the game over screen isn't measured, it is cheap but runs at the idle frame limit which would read as slow frames
+		bool measured = (workms >= 0 && !IsTitle && !Game.gameover && !Idle.active);
+		if (measured && Perf.log) PerfFrame(workms, ZLELAPSED * 1000);
+		if (measured) GovernorFrame(workms, ZLELAPSED * 1000);
+		MetricsEndFrame();
+		if (AllocCheck.seconds) AllocCheckFrame();
+
+		bool flowchanged = UpdateFlow();
+		// mouse look is applied as late as possible, right before the camera is set up (shots in the next tick use this view)
+		if (!IsTitle && !Game.gameover && !Bot.active) ApplyMouseLook();
+
+		int drawbuf = simbuf;
+		simbuf ^= 1;
+		InputFrame input = CaptureInput(!flowchanged); //the input that changed the game flow is not also used for playing
+		if (Bot.active && !IsTitle && !Game.gameover) { input = BotInput(Game, input); ViewDir = input.dir; }
+		if (Net.active && !IsTitle) { NetServerFrame(); NetClientFrame(input); NetReportFrame(); }
+		SimStart(input);
+		RenderState& drawn = RenderStates[SimThread.pipelined ? drawbuf : simbuf];
+		if (Net.active && !drawn.title && Net.client) NetClientView(drawn);
+		IdleFrame(drawn, workms);
+		if (Idle.active && drawn.gameover) DrawFrozen(drawn);
+		else ::Draw(drawn);
+		workms = (float)(TimeMs() - framestart);
+		if (Perf.log && !drawn.title && !WarmUp.reported)
+		{
+			printf("First game frame: %.2f ms (%s)\n", workms, (WarmUp.enabled ? *ZL_String::format("warm-up during load took %.2f ms", WarmUp.ms) : "warm-up disabled"));
+			WarmUp.reported = true;
+		}
+		if (InputLatency.active) InputLatencyFrame();
+		if (Bot.active && !AllocCheck.seconds) { Soak.times.Add(ZLELAPSED * 1000); SoakReport(Game.wave, "frame"); }
+		if (!AssetLoad.firstframe && Perf.log) printf("Time to first frame: %.1f ms\n", TimeMs() - AssetLoad.start);
+		AssetLoad.firstframe = true;
+		LoadFrame();
+	}
+	float workms = -1;
+
+	void OnInputEvent()
+	{
+		Idle.lastinput = TimeMs();
+		if (InputLatency.active && !InputLatency.pending) InputLatency.pending = Idle.lastinput;
 	}
+	void OnPointerMove(ZL_PointerMoveEvent&) { OnInputEvent(); }
+	void OnPointerDown(ZL_PointerPressEvent&) { OnInputEvent(); }
+	void OnKeyDown(ZL_KeyboardEvent&) { OnInputEvent(); }
 } Shootzilla;
 
 #if 1 // MUSIC/SOUND DATA